@@ -0,0 +1,442 @@
+//=============================================================================================
+// Micro benchmark suite of the CPU math (framework.h, vecbatch.h, vecexpr.h, fastmath.h), no OpenGL context needed.
+// GrafHfBench is built as the program is, GrafHfBenchScalar is the same code with FRAMEWORK_SIMD=0.
+//   GrafHfBench [--json out.json] [--compare baseline.json] [--max-slowdown 1.25] [--filter text]
+// --json writes ns/op and throughput of every case, --compare prints the speedup against an earlier
+// --json file, and with --max-slowdown the exit code is 1 if any case got slower than that factor.
+// Before the timing the vec4 and mat4 operators are checked bit by bit against scalar loops, the inverses
+// and the batch transforms against the identity and vec4 * mat4, and the floatx8 fast math against the scalar
+// functions bit by bit. A failed check exits with 1 too.
+// The 'bench' target runs the scalar build, then the SIMD build compared against it.
+//=============================================================================================
+#include "framework.h"
+#include "vecbatch.h"
+#include "vecexpr.h"
+#include "fastmath.h"
+#include <chrono>
+#include <string>
+#include <string.h>
+
+const int nData = 1024;				// working set that fits in L1
+const int nRepeat = 4000;
+const int nRuns = 5;				// the fastest run counts, the others are disturbed by the rest of the machine
+
+std::vector<vec3> vec3s;
+std::vector<vec4> vec4s;
+std::vector<mat4> mat4s;
+volatile float sink;				// keeps the optimizer from dropping the results
+
+float rnd() { return (float)rand() / RAND_MAX; }
+
+struct BenchResult {
+	std::string name;
+	double nsPerOp;
+	double maxError;				// against double precision, negative if not measured
+};
+
+std::vector<BenchResult> results;
+const char * filter = NULL;			// only cases whose name contains this run
+
+// runs op(i) for every stride-th element nRepeat times and stores the time of one element in nanoseconds,
+// batch cases use the stride of their width so the time is per value
+template<typename Op>
+void bench(const char * name, Op op, int stride = 1, double maxError = -1) {
+	if (filter && !strstr(name, filter)) return;
+	BenchResult result;
+	result.name = name;
+	result.nsPerOp = 1e30;
+	for (int run = 0; run < nRuns; run++) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < nRepeat; r++) {
+			for (int i = 0; i < nData; i += stride) op(i);
+		}
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		double ns = std::chrono::duration<double, std::nano>(tEnd - tStart).count() / ((double)nRepeat * nData);
+		if (ns < result.nsPerOp) result.nsPerOp = ns;
+	}
+	result.maxError = maxError;
+	results.push_back(result);
+	if (maxError >= 0) printf("%-28s %8.2f ns %10.1f Mop/s  max error %.2g\n", name, result.nsPerOp, 1000 / result.nsPerOp, maxError);
+	else printf("%-28s %8.2f ns %10.1f Mop/s\n", name, result.nsPerOp, 1000 / result.nsPerOp);
+}
+
+const char * variant() {
+#if FRAMEWORK_SIMD
+	return "simd";
+#else
+	return "scalar";
+#endif
+}
+
+void writeJson(const char * fileName) {	// one case per line, so readJson can stay a line scanner
+	FILE * file = fopen(fileName, "w");
+	if (!file) { printf("cannot write %s\n", fileName); return; }
+	fprintf(file, "{\n  \"variant\": \"%s\",\n  \"results\": [\n", variant());
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(file, "    {\"name\": \"%s\", \"ns_per_op\": %.4f, \"mops_per_s\": %.2f", results[i].name.c_str(), results[i].nsPerOp, 1000 / results[i].nsPerOp);
+		if (results[i].maxError >= 0) fprintf(file, ", \"max_error\": %.3g", results[i].maxError);
+		fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+}
+
+std::vector<BenchResult> readJson(const char * fileName) {
+	std::vector<BenchResult> baseline;
+	FILE * file = fopen(fileName, "r");
+	if (!file) { printf("cannot read %s\n", fileName); return baseline; }
+	char line[512];
+	while (fgets(line, sizeof(line), file)) {
+		const char * name = strstr(line, "\"name\": \"");
+		const char * ns = strstr(line, "\"ns_per_op\": ");
+		if (!name || !ns) continue;
+		name += strlen("\"name\": \"");
+		BenchResult result;
+		result.name = std::string(name, strchr(name, '"') - name);
+		result.nsPerOp = atof(ns + strlen("\"ns_per_op\": "));
+		result.maxError = -1;
+		baseline.push_back(result);
+	}
+	fclose(file);
+	return baseline;
+}
+
+// prints the speedup of every case against the baseline, returns the number of cases slower than maxSlowdown
+int compare(const std::vector<BenchResult>& baseline, double maxSlowdown) {
+	int nSlower = 0;
+	printf("\n%-28s %11s %11s %8s\n", "speedup against baseline", "baseline", "now", "speedup");
+	for (size_t i = 0; i < results.size(); i++) {
+		for (size_t j = 0; j < baseline.size(); j++) {
+			if (baseline[j].name != results[i].name) continue;
+			double speedup = baseline[j].nsPerOp / results[i].nsPerOp;
+			bool slower = maxSlowdown > 0 && results[i].nsPerOp > baseline[j].nsPerOp * maxSlowdown;
+			if (slower) nSlower++;
+			printf("%-28s %8.2f ns %8.2f ns %7.2fx%s\n", results[i].name.c_str(), baseline[j].nsPerOp, results[i].nsPerOp, speedup, slower ? "  SLOWER" : "");
+		}
+	}
+	return nSlower;
+}
+
+void benchVectors() {
+	vec2 v2Acc;
+	bench("vec2 + vec2 * float", [&](int i) { v2Acc = vec2(vec3s[i].x, vec3s[i].y) + vec2(vec4s[i].x, vec4s[i].y) * 0.5f; sink = v2Acc.y; });
+
+	vec3 v3Acc;
+	bench("vec3 + vec3 * float", [&](int i) { v3Acc = vec3s[i] + vec3s[(i + 1) % nData] * 0.5f; sink = v3Acc.z; });
+	bench("vec3 - vec3", [&](int i) { v3Acc = vec3s[i] - vec3s[(i + 1) % nData]; sink = v3Acc.x; });
+	bench("vec3 * vec3", [&](int i) { v3Acc = vec3s[i] * vec3s[(i + 1) % nData]; sink = v3Acc.x; });
+	bench("dot(vec3)", [&](int i) { sink = dot(vec3s[i], vec3s[(i + 1) % nData]); });
+	bench("length(vec3)", [&](int i) { sink = length(vec3s[i]); });
+	bench("normalize(vec3)", [&](int i) { v3Acc = normalize(vec3s[i]); sink = v3Acc.x; });
+	bench("cross(vec3)", [&](int i) { v3Acc = cross(vec3s[i], vec3s[(i + 1) % nData]); sink = v3Acc.y; });
+
+	vec4 v4Acc;
+	bench("vec4 + vec4 * float", [&](int i) { v4Acc = vec4s[i] + vec4s[(i + 1) % nData] * 0.5f; sink = v4Acc.w; });
+	bench("vec4 * vec4", [&](int i) { v4Acc = vec4s[i] * vec4s[(i + 1) % nData]; sink = v4Acc.w; });
+	bench("dot(vec4)", [&](int i) { sink = dot(vec4s[i], vec4s[(i + 1) % nData]); });
+}
+
+void benchMatrices() {
+	mat4 mAcc = mat4s[0];
+	bench("TranslateMatrix", [&](int i) { mAcc = TranslateMatrix(vec3s[i]); sink = mAcc.m[3][0]; });
+	bench("ScaleMatrix", [&](int i) { mAcc = ScaleMatrix(vec3s[i]); sink = mAcc.m[1][1]; });
+	bench("RotationMatrix", [&](int i) { mAcc = RotationMatrix(vec4s[i].x, vec3s[i]); sink = mAcc.m[0][1]; });
+	bench("mat4 * mat4", [&](int i) { mAcc = mat4s[i] * mat4s[(i + 1) % nData]; sink = mAcc.m[3][0]; });
+	bench("mulAffine", [&](int i) { mAcc = mulAffine(mat4s[i], mat4s[(i + 1) % nData]); sink = mAcc.m[3][0]; });
+	bench("transpose", [&](int i) { mAcc = transpose(mat4s[i]); sink = mAcc.m[3][0]; });
+	bench("inverse", [&](int i) { mAcc = inverse(mat4s[i]); sink = mAcc.m[3][0]; });
+	bench("inverseAffine", [&](int i) { mAcc = inverseAffine(mat4s[i]); sink = mAcc.m[3][0]; });
+
+	vec4 vAcc;
+	bench("vec4 * mat4", [&](int i) { vAcc = vec4s[i] * mat4s[i]; sink = vAcc.x; });
+
+	std::vector<vec3> points(vec3s);	// one vec4 * mat4 per point against the batch transform, both per point
+	bench("point * mat4", [&](int i) {
+		vec4 p = vec4(points[i].x, points[i].y, points[i].z, 1) * mat4s[0];
+		points[i] = vec3(p.x, p.y, p.z);
+	});
+	bench("transformPoints", [&](int) { transformPoints(mat4s[0], points); }, nData);
+}
+
+// the vec4 and mat4 operators against plain float loops that sum in the same order, so any vectorized form of them
+// has to give the bits of the scalar code. Returns the number of operators with a differing result.
+int checkOperators() {
+	std::vector<vec4> as(nData), bs(nData);
+	std::vector<mat4> ms(nData);
+	for (int i = 0; i < nData; i++) {
+		as[i] = vec4(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f);
+		bs[i] = vec4(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f);
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) ms[i].m[r][c] = rnd() - 0.5f;
+		}
+	}
+	int nMismatch[8] = { 0 };
+	const char * names[8] = { "vec4 * float", "vec4 / float", "vec4 + vec4", "vec4 - vec4", "vec4 * vec4", "vec4 += vec4", "vec4 * mat4", "mat4 * mat4" };
+	for (int i = 0; i < nData; i++) {
+		const vec4& a = as[i];
+		const vec4& b = bs[i];
+		const mat4& m = ms[i];
+		const mat4& n = ms[(i + 1) % nData];
+		float f = b.x + 1;	// away from 0 for the division
+		float ref[5][4] = {
+			{ a.x * f, a.y * f, a.z * f, a.w * f },
+			{ a.x / f, a.y / f, a.z / f, a.w / f },
+			{ a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w },
+			{ a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w },
+			{ a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w } };
+		vec4 results[5] = { a * f, a / f, a + b, a - b, a * b };
+		for (int k = 0; k < 5; k++) {
+			if (memcmp(&results[k], ref[k], sizeof(ref[k]))) nMismatch[k]++;
+		}
+		vec4 sum = a;
+		sum += b;
+		if (memcmp(&sum, ref[2], sizeof(ref[2]))) nMismatch[5]++;
+
+		float av[4] = { a.x, a.y, a.z, a.w }, vm[4], mm[4][4];
+		for (int c = 0; c < 4; c++) vm[c] = av[0] * m.m[0][c] + av[1] * m.m[1][c] + av[2] * m.m[2][c] + av[3] * m.m[3][c];
+		vec4 v = a * m;
+		if (memcmp(&v, vm, sizeof(vm))) nMismatch[6]++;
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) {
+				mm[r][c] = 0;
+				for (int k = 0; k < 4; k++) mm[r][c] += m.m[r][k] * n.m[k][c];
+			}
+		}
+		mat4 product = m * n;
+		if (memcmp(product.m, mm, sizeof(mm))) nMismatch[7]++;
+	}
+	int nFailed = 0;
+	for (int k = 0; k < 8; k++) {
+		char name[64];
+		sprintf(name, "check %s", names[k]);
+		printf("%-36s %d of %d differ%s\n", name, nMismatch[k], nData, nMismatch[k] ? "  FAILED" : "");
+		if (nMismatch[k]) nFailed++;
+	}
+	return nFailed;
+}
+
+// inverse(m) * m against the identity and the batch transforms against one vec4 * mat4 per vector,
+// for counts with and without a tail after the groups of 4. Returns the number of failed checks.
+int checkMatrices() {
+	const float maxError = 1e-4f;	// absolute, the inputs are about 1 in size
+	std::vector<mat4> projectives(mat4s);	// last column off (0, 0, 0, 1), for inverse and the division by w
+	for (int i = 0; i < nData; i++) {
+		mat4& m = projectives[i];
+		m.m[0][3] = (rnd() - 0.5f) * 0.5f; m.m[1][3] = (rnd() - 0.5f) * 0.5f; m.m[2][3] = (rnd() - 0.5f) * 0.5f; m.m[3][3] = 1 + rnd();
+	}
+	float inverseError = 0, inverseAffineError = 0;
+	for (int i = 0; i < nData; i++) {
+		mat4 general = inverse(projectives[i]) * projectives[i], affine = inverseAffine(mat4s[i]) * mat4s[i];
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) {
+				float identity = (r == c) ? 1.0f : 0.0f;
+				inverseError = fmaxf(inverseError, fabsf(general.m[r][c] - identity));
+				inverseAffineError = fmaxf(inverseAffineError, fabsf(affine.m[r][c] - identity));
+			}
+		}
+	}
+	int nFailed = 0;
+	printf("%-36s max error %.2g%s\n", "check inverse", inverseError, inverseError > maxError ? "  FAILED" : "");
+	printf("%-36s max error %.2g%s\n", "check inverseAffine", inverseAffineError, inverseAffineError > maxError ? "  FAILED" : "");
+	if (inverseError > maxError) nFailed++;
+	if (inverseAffineError > maxError) nFailed++;
+
+	const int counts[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, nData - 1, nData };
+	const mat4 * matrices[] = { &mat4s[0], &projectives[0] };
+	for (int k = 0; k < 2; k++) {
+		const mat4& m = *matrices[k];
+		for (int w = 1; w >= 0; w--) {
+			float transformError = 0;
+			for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+				std::vector<vec3> batch(vec3s.begin(), vec3s.begin() + counts[c]);
+				if (w) transformPoints(m, batch);
+				else transformDirections(m, batch);
+				for (int i = 0; i < counts[c]; i++) {
+					vec4 r = vec4(vec3s[i].x, vec3s[i].y, vec3s[i].z, (float)w) * m;
+					if (w && !isAffine(m)) r = r / r.w;
+					transformError = fmaxf(transformError, fmaxf(fabsf(batch[i].x - r.x), fmaxf(fabsf(batch[i].y - r.y), fabsf(batch[i].z - r.z))));
+				}
+			}
+			char name[64];
+			sprintf(name, "check %s %s", w ? "transformPoints" : "transformDirections", k ? "projective" : "affine");
+			printf("%-36s max error %.2g%s\n", name, transformError, transformError > maxError ? "  FAILED" : "");
+			if (transformError > maxError) nFailed++;
+		}
+	}
+	return nFailed;
+}
+
+void benchBatches() {
+	// Sphere::collide of sphere i against 8 others, once with branches and once as masks over a vec3x8 batch
+	const float radius = 0.2f;
+	std::vector<vec3> forces(vec3s.size());
+	for (int i = 0; i < nData; i++) forces[i] = vec3(rnd() - 0.5f, rnd() - 0.5f, 0);
+	int nCollisions = 0;
+	bench("collide 8 pairs scalar", [&](int i) {
+		for (int j = i & ~7; j < (i & ~7) + 8; j++) {
+			vec3 d = vec3s[i] - vec3s[j];
+			if (length(d) <= radius + radius && dot(d, forces[i]) < 0) nCollisions++;
+		}
+	});
+	std::vector<vec3x8> centers8(nData / 8);	// the same centers kept in SoA layout
+	for (int j = 0; j < nData; j += 8) centers8[j / 8].load(vec3s, j);
+	bench("collide 8 pairs vec3x8", [&](int i) {
+		vec3x8 d = vec3x8(vec3s[i]) - centers8[i / 8];
+		maskx8 hit = length(d) <= floatx8(radius + radius) && dot(d, vec3x8(forces[i])) < floatx8(0);
+		nCollisions += count(hit);
+	});
+	sink = (float)nCollisions;
+
+	// reflection of Scene::Animate, force = force - n * 2 * dot(force, n), with the operators and with vecexpr.h
+	std::vector<vec3> normals(vec3s.size());
+	for (int i = 0; i < nData; i++) normals[i] = normalize(vec3s[(i + 1) % nData]);
+	bench("reflect operators", [&](int i) {
+		vec3& force = forces[i];
+		const vec3& n = normals[i];
+		force = force - n * 2 * dot(force, n);
+	});
+	bench("reflect vecexpr", [&](int i) {
+		vec3& force = forces[i];
+		const vec3& n = normals[i];
+		assign(force, ex(force) - ex(n) * 2 * dot(force, n));
+	});
+	sink = forces[0].x;
+}
+
+bool sameBits(float a, float b) { return !memcmp(&a, &b, sizeof(float)) || (a != a && b != b); }	// any NaN is a NaN
+
+// the floatx8 versions of fastmath.h, and so the __m128 ones of the SIMD build, against the scalar functions,
+// which are the ones benchFastMath measures the error of. Over the documented ranges and the out of range inputs.
+// Returns the number of functions with a differing result.
+int checkFastMath() {
+	std::vector<float> xs, ys;
+	for (int i = 0; i < nData; i++) {
+		xs.push_back(i % 2 ? (rnd() * 2 - 1) * 8192 : 0.001f + rnd() * 10);
+		ys.push_back((rnd() * 2 - 1) * 10);
+	}
+	const float specials[] = { 0, -0.0f, -1, 1, 0.5f, 200, -200, 1e-30f, 8192, -8192 };
+	for (float special : specials) {
+		xs.push_back(special);
+		ys.push_back(-special);
+	}
+	while (xs.size() % 8) { xs.push_back(1); ys.push_back(1); }
+	int nMismatch[7] = { 0 };
+	const char * names[7] = { "fastSin x8", "fastCos x8", "fastTan x8", "fastExp2 x8", "fastLog2 x8", "fastPow x8", "fastRsqrt x8" };
+	for (size_t i = 0; i < xs.size(); i += 8) {
+		floatx8 x, y, s, c;
+		for (int k = 0; k < 8; k++) { x[k] = xs[i + k]; y[k] = ys[i + k]; }
+		fastSinCos(x, s, c);
+		floatx8 results[7] = { s, c, fastTan(x), fastExp2(x * floatx8(0.02f)), fastLog2(x), fastPow(x, y), fastRsqrt(x) };
+		for (int k = 0; k < 8; k++) {
+			float a = xs[i + k], b = ys[i + k];
+			float refs[7] = { fastSin(a), fastCos(a), fastTan(a), fastExp2(a * 0.02f), fastLog2(a), fastPow(a, b), fastRsqrt(a) };
+			for (int f = 0; f < 7; f++) {
+				if (!sameBits(results[f][k], refs[f])) nMismatch[f]++;
+			}
+		}
+	}
+	int nFailed = 0;
+	for (int f = 0; f < 7; f++) {
+		char name[64];
+		sprintf(name, "check %s", names[f]);
+		printf("%-36s %d of %d differ%s\n", name, nMismatch[f], (int)xs.size(), nMismatch[f] ? "  FAILED" : "");
+		if (nMismatch[f]) nFailed++;
+	}
+	return nFailed;
+}
+
+void benchFastMath() {	// ns per value, the x8 cases too, and largest error against the double precision function,
+	// which holds for the x8 cases as checkFastMath finds them giving the bits of the scalar functions
+	// the error bounds in fastmath.h are measured here, over the ranges it documents
+	std::vector<float> angles(nData), positives(nData), exponents(nData), exp2Args(nData);
+	for (int i = 0; i < nData; i++) {
+		angles[i] = (rnd() * 2 - 1) * 8192;
+		positives[i] = 0.001f + rnd() * 10;
+		exponents[i] = (rnd() * 2 - 1) * 10;
+		exp2Args[i] = -126 + rnd() * 253;
+	}
+	double maxErr = 0;
+	for (int i = 0; i < nData; i++) maxErr = fmax(maxErr, fabs(fastSin(angles[i]) - sin((double)angles[i])));
+	bench("sinf + cosf", [&](int i) { sink = sinf(angles[i]) + cosf(angles[i]); });
+	bench("fastSinCos", [&](int i) { float s, c; fastSinCos(angles[i], s, c); sink = s + c; }, 1, maxErr);
+	bench("fastSinCos x8", [&](int i) {
+		floatx8 x, s, c;
+		for (int k = 0; k < 8; k++) x[k] = angles[i + k];
+		fastSinCos(x, s, c);
+		sink = s[0] + c[7];
+	}, 8, maxErr);
+
+	maxErr = 0;		// relative to the 1 / cos^2 x growth of tan around its poles
+	for (int i = 0; i < nData; i++) {
+		double c = cos((double)angles[i]);
+		maxErr = fmax(maxErr, fabs(fastTan(angles[i]) - tan((double)angles[i])) * c * c);
+	}
+	bench("tanf", [&](int i) { sink = tanf(angles[i]); });
+	bench("fastTan", [&](int i) { sink = fastTan(angles[i]); }, 1, maxErr);
+
+	maxErr = 0;
+	for (int i = 0; i < nData; i++) {
+		double exact = pow((double)positives[i], (double)exponents[i]);
+		maxErr = fmax(maxErr, fabs(fastPow(positives[i], exponents[i]) - exact) / exact);
+	}
+	bench("powf", [&](int i) { sink = powf(positives[i], exponents[i]); });
+	bench("fastPow", [&](int i) { sink = fastPow(positives[i], exponents[i]); }, 1, maxErr);
+	bench("fastPow x8", [&](int i) {
+		floatx8 x, y;
+		for (int k = 0; k < 8; k++) { x[k] = positives[i + k]; y[k] = exponents[i + k]; }
+		sink = fastPow(x, y)[3];
+	}, 8, maxErr);
+
+	maxErr = 0;
+	for (int i = 0; i < nData; i++) maxErr = fmax(maxErr, fabs(fastExp2(exp2Args[i]) - exp2((double)exp2Args[i])) / exp2((double)exp2Args[i]));
+	bench("exp2f", [&](int i) { sink = exp2f(exp2Args[i]); });
+	bench("fastExp2", [&](int i) { sink = fastExp2(exp2Args[i]); }, 1, maxErr);
+
+	maxErr = 0;
+	for (int i = 0; i < nData; i++) maxErr = fmax(maxErr, fabs(fastLog2(positives[i]) - log2((double)positives[i])));
+	bench("log2f", [&](int i) { sink = log2f(positives[i]); });
+	bench("fastLog2", [&](int i) { sink = fastLog2(positives[i]); }, 1, maxErr);
+
+	maxErr = 0;
+	for (int i = 0; i < nData; i++) maxErr = fmax(maxErr, fabs(fastRsqrt(positives[i]) * sqrt((double)positives[i]) - 1));
+	bench("1 / sqrtf", [&](int i) { sink = 1 / sqrtf(positives[i]); });
+	bench("fastRsqrt", [&](int i) { sink = fastRsqrt(positives[i]); }, 1, maxErr);
+}
+
+int main(int argc, char * argv[]) {
+	const char * jsonFile = NULL, * baselineFile = NULL;
+	double maxSlowdown = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json") && i + 1 < argc) jsonFile = argv[++i];
+		else if (!strcmp(argv[i], "--compare") && i + 1 < argc) baselineFile = argv[++i];
+		else if (!strcmp(argv[i], "--max-slowdown") && i + 1 < argc) maxSlowdown = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--filter") && i + 1 < argc) filter = argv[++i];
+		else { printf("usage: %s [--json out.json] [--compare baseline.json] [--max-slowdown factor] [--filter text]\n", argv[0]); return 2; }
+	}
+
+	for (int i = 0; i < nData; i++) {
+		vec3s.push_back(vec3(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f));
+		vec4s.push_back(vec4(rnd(), rnd(), rnd(), 1));
+		mat4s.push_back(RotationMatrix(rnd() * 2 * M_PI, vec3s[i]) * TranslateMatrix(vec3s[i]));
+	}
+	printf("variant: %s\n", variant());
+	int nFailed = checkOperators() + checkMatrices() + checkFastMath();
+	benchVectors();
+	benchMatrices();
+	benchBatches();
+	benchFastMath();
+
+	if (jsonFile) writeJson(jsonFile);
+	if (nFailed > 0) {
+		printf("%d checks failed\n", nFailed);
+		return 1;
+	}
+	if (baselineFile) {
+		int nSlower = compare(readJson(baselineFile), maxSlowdown);
+		if (nSlower > 0) {
+			printf("%d cases are more than %.2fx slower than the baseline\n", nSlower, maxSlowdown);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -2,27 +2,27 @@
 // Computer Graphics Sample Program: GPU ray casting
 //=============================================================================================
 #include "framework.h"
+#include "bvh.h"
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
 
 // vertex shader in GLSL
 const char *vertexSource = R"(
 	#version 330
     precision highp float;
 
-	uniform vec3 wLookAt, wRight, wUp;          // pos of eye
-
 	layout(location = 0) in vec2 cCamWindowVertex;	// Attrib Array 0
-	out vec3 p;
+	out vec2 cCamWindow;	// the point on the camera window is computed from it with the camera of the scene block
 
 	void main() {
 		gl_Position = vec4(cCamWindowVertex, 0, 1);
-		p = wLookAt + wRight * cCamWindowVertex.x + wUp * cCamWindowVertex.y;
+		cCamWindow = cCamWindowVertex;
 	}
 )";
-// fragment shader in GLSL
-//Frenel snis knyv 120. o
-//Vik wiki-s helper doksi
-const char *fragmentSource = R"(
-	#version 330
+// The scene and the intersection code of the tracers, both the fragment and the compute shaders start with it. Each
+// shader defines the get* functions declared here on its texture buffers or storage blocks.
+const char *traceSource = R"(
     precision highp float;
 
 	struct Material {
@@ -37,93 +37,276 @@ const char *fragmentSource = R"(
 		vec3 Le, La;
 	};
 
-	struct Sphere {
-		vec3 center;
-		float radius;
-	};
-
 	struct Hit {
 		float t;
 		vec3 position, normal;
 		int mat;	// material index
+		int object;	// BVH slot of the sphere
 	};
 
 	struct Ray {
 		vec3 start, dir;
 	};
 
-    struct Plane{
-        vec3 normal;
-        vec3 point;
-    };
-
-	const int nMaxObjects = 100;
-	uniform vec3 wEye;
-	uniform Light light;
-	uniform Material materials[5];  // diffuse, specular, ambient ref
-	uniform int nObjects;
-    uniform int nPlanes;
-	uniform Sphere objects[nMaxObjects];
-    uniform Plane planes[nMaxObjects];
-    uniform bool isGold;
-
-	in  vec3 p;					// point on camera window corresponding to the pixel
-	out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
+	struct Prism {		// regular prism of mirrors around the z axis, facet k has the outward normal at angle rotation + k * 2pi / nSides
+		int nSides;		// 0: no prism
+		float apothem, zMin, zMax;
+		float rotation;
+		int mat;
+	};
 
-	Hit intersect(const Sphere object, const Ray ray) {
-		Hit hit;
-		hit.t = -1;
-		vec3 dist = ray.start - object.center;
+	layout(std140) uniform SceneBlock {	// SceneData on the CPU
+		vec3 wEye;
+		int nObjects;
+		vec3 wLookAt;
+		int nPlanes;
+		vec3 wRight, wUp;
+		Light light;
+		Material materials[5];  // diffuse, specular, ambient ref
+		Prism prism;
+	};
+	uniform int objectBase;					// first sphere of this frame in the ring buffer
+	uniform int nodeBase, nNodes;
+#if defined(WAVEFRONT) || defined(COMPUTE)
+	const int virtualImages = 0;			// the images stay in the one pass fragment program
+#else
+	uniform int virtualImages;				// 1: the spheres are replaced by their mirror images and only primary rays are cast
+#endif
+	uniform int slabGrid;					// 1: the spheres lie in the slab gridSlab.x < z < gridSlab.y, the grid is walked instead of the BVH
+	uniform vec4 gridBox;					// lo.xy and size of a cell of the grid over the slab
+	uniform vec2 gridSlab;
+	uniform int gridWidth, gridHeight;
+	uniform int depthCap;					// at most maxdepth segments per path
+	uniform float minWeight;				// a path ends when its largest weight component falls below it
+	uniform float rouletteWeight;			// 0: off, below it a path survives with probability weight / rouletteWeight
+	uniform int frameSeed;
+	uniform int bounceView;					// 1: the number of segments traced per pixel instead of the image
+	uniform int shadowMap;					// 1: the spheres in the way of the light are looked up in a map before any shadow ray
+	uniform vec4 shadowBox;					// lo.uv and size of a texel
+	uniform int shadowWidth, shadowHeight;
+	uniform vec3 shadowU, shadowV, shadowW;	// light space, shadowW is the light direction
+	uniform sampler2D accumulation;			// mean of the previous samples of each pixel
+	uniform int sampleIndex;				// 0: the first sample after a change, in the pixel center
+	uniform vec2 jitter;					// offset of this sample from the pixel center in pixels
+	uniform int tileCulling;				// 1: the eye ray of a pixel only tests the spheres overlapping its screen tile
+	uniform int tileColumns;				// tiles per row of the render target
+
+	vec4 getObject(int o);			// vec4(center, radius) of the sphere in BVH slot o, at objectBase + o
+	int getObjectMaterial(int o);
+	vec4 getPlane(int i);			// vec4(normal, material index) and vec4(point, 0) of plane o at 2o and 2o + 1
+	vec4 getNode(int i);			// of the BVH at nodeBase: vec4(lo, skip) and vec4(hi, first * 8 + count) of node n at 2n and 2n + 1
+	ivec2 getGridCell(int c);		// first and count in the sphere list of the grid of cell x + y * gridWidth
+	int getGridSphere(int k);
+	vec4 getShadowTexel(int i);		// vec4(highest top, its slot, second highest top, highest bottom of a sphere covering the texel)
+	bool seesImage(int o, Ray ray);	// the images are only seen through their chain of facets
+	int getImageCell(int o);
+	Hit tileIntersect(Ray ray, float tMax);
+
+	const float PI = 3.14159265;
+	const float epsilon = 0.0001f;
+	const int maxdepth = 10;
+	ivec2 pixel;			// of the full render target
+	int bounces = 0;		// segments traced for the pixel
+	int rayTile = -1;		// of the pixel while its eye ray is traced, -1 for the later rays
+
+	bool hitBox(vec3 lo, vec3 hi, Ray ray, vec3 invDir, float tMax) {	// slab test against [0, tMax]
+		vec3 t0 = (lo - ray.start) * invDir, t1 = (hi - ray.start) * invDir;
+		vec3 tNear = min(t0, t1), tFar = max(t0, t1);
+		float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0));
+		float tExit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+		return tEnter <= tExit;
+	}
+
+	float intersectSphere(vec4 sphere, Ray ray) {	// t of the first hit, < 0 if none
+		vec3 dist = ray.start - sphere.xyz;
 		float a = dot(ray.dir, ray.dir);
 		float b = dot(dist, ray.dir) * 2.0;
-		float c = dot(dist, dist) - object.radius * object.radius;
+		float c = dot(dist, dist) - sphere.w * sphere.w;
 		float discr = b * b - 4.0 * a * c;
-		if (discr < 0) return hit;
+		if (discr < 0) return -1.0;
 		float sqrt_discr = sqrt(discr);
 		float t1 = (-b + sqrt_discr) / 2.0 / a;	// t1 >= t2 for sure
 		float t2 = (-b - sqrt_discr) / 2.0 / a;
-		if (t1 <= 0) return hit;
-		hit.t = (t2 > 0) ? t2 : t1;
-		hit.position = ray.start + ray.dir * hit.t;
-		hit.normal = (hit.position - object.center) / object.radius;
+		if (t1 <= 0) return -1.0;
+		return (t2 > 0) ? t2 : t1;
+	}
+
+	Hit sphereHit(int o, float t, Ray ray) {	// the closest sphere, once it is known
+		vec4 sphere = getObject(o);
+		Hit hit;
+		hit.t = t;
+		hit.position = ray.start + ray.dir * t;
+		hit.normal = (hit.position - sphere.xyz) / sphere.w;
+		hit.mat = getObjectMaterial(o);
+		hit.object = o;
 		return hit;
 	}
-    Hit intersect(const Plane oPlane, const Ray ray){
+
+    Hit intersectPlane(int o, Ray ray) {
         Hit hit;
         hit.t = -1;
-        float nevezo = dot(ray.dir, oPlane.normal);
+        vec4 normal = getPlane(2 * o), point = getPlane(2 * o + 1);
+        float nevezo = dot(ray.dir, normal.xyz);
         if( nevezo == 0) return hit;
-        float szamlalo = dot(oPlane.point-ray.start, oPlane.normal);
+        float szamlalo = dot(point.xyz - ray.start, normal.xyz);
         hit.t = szamlalo/nevezo;
 		hit.position = ray.start + ray.dir * hit.t;
-        if(hit.position.z - oPlane.point.z > 7 || hit.position.z - oPlane.point.z < -7){
+        if(hit.position.z - point.z > 7 || hit.position.z - point.z < -7){
             hit.t = -1;
             return hit;
         }
-        hit.normal = oPlane.normal;
+        hit.normal = normal.xyz;
+        hit.mat = int(normal.w);     // gold or silver mirror
+        hit.object = -1;
         return hit;
     }
 
-	Hit firstIntersect(Ray ray) {
-		Hit bestHit;
-		bestHit.t = -1;
-		for (int o = 0; o < nObjects; o++) {
-			Hit hit = intersect(objects[o], ray); //  hit.t < 0 if no intersection
-            hit.mat = o%3;	 // half of the objects are rough
-			if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
+	// O(1) in the number of facets: the ray leaves the circumscribed circle in the sector of the facet it hits, because the
+	// part of the ray between the two exit points stays in the circle segment cut off by that facet
+	Hit intersectPrism(Ray ray) {
+		Hit hit;
+		hit.t = -1;
+		if (prism.nSides < 3) return hit;
+		vec2 s = ray.start.xy, d = ray.dir.xy;
+		float sector = 2 * PI / prism.nSides;
+		float R = prism.apothem / cos(sector / 2);
+		float a = dot(d, d), b = dot(s, d), c = dot(s, s) - R * R;
+		float discr = b * b - a * c;
+		if (a == 0 || discr < 0) return hit;
+		vec2 q = s + d * ((-b + sqrt(discr)) / a);
+		float angle = prism.rotation + round((atan(q.y, q.x) - prism.rotation) / sector) * sector;
+		vec2 n = vec2(cos(angle), sin(angle));
+		float nevezo = dot(d, n);
+		if (nevezo <= 0) return hit;
+		hit.t = (prism.apothem - dot(s, n)) / nevezo;
+		hit.position = ray.start + ray.dir * hit.t;
+		if (hit.position.z < prism.zMin || hit.position.z > prism.zMax) {
+			hit.t = -1;
+			return hit;
+		}
+		hit.normal = vec3(-n, 0);
+		hit.mat = prism.mat;
+		hit.object = -1;
+		return hit;
+	}
+
+	// Clips the ray to the slab and the box of the grid, then visits the cells it crosses in order until the closest hit so
+	// far is in the cell. A shadow ray returns the first hit of a sphere of the cell, or any sphere if cell < 0.
+	Hit gridIntersect(Ray ray, float tMax, bool shadow, int cell) {
+		Hit hit;
+		hit.t = -1;
+		vec2 lo = gridBox.xy, size = gridBox.zw, hi = lo + size * vec2(gridWidth, gridHeight);
+		vec3 lo3 = vec3(lo, gridSlab.x), hi3 = vec3(hi, gridSlab.y);
+		float t0 = 0, t1 = tMax;
+		for (int i = 0; i < 3; i++) {
+			if (ray.dir[i] == 0) {
+				if (ray.start[i] < lo3[i] || ray.start[i] > hi3[i]) return hit;
+				continue;
+			}
+			float ta = (lo3[i] - ray.start[i]) / ray.dir[i], tb = (hi3[i] - ray.start[i]) / ray.dir[i];
+			t0 = max(t0, min(ta, tb));
+			t1 = min(t1, max(ta, tb));
+		}
+		if (t0 > t1) return hit;
+		vec2 s = ray.start.xy, d = ray.dir.xy;
+		ivec2 c = clamp(ivec2(floor((s + d * t0 - lo) / size)), ivec2(0), ivec2(gridWidth - 1, gridHeight - 1));
+		ivec2 step = ivec2(sign(d));
+		vec2 tDelta = vec2(d.x != 0 ? size.x / abs(d.x) : 1e30, d.y != 0 ? size.y / abs(d.y) : 1e30);
+		vec2 tNext = vec2(d.x != 0 ? (lo.x + float(c.x + (d.x > 0 ? 1 : 0)) * size.x - s.x) / d.x : 1e30,
+						  d.y != 0 ? (lo.y + float(c.y + (d.y > 0 ? 1 : 0)) * size.y - s.y) / d.y : 1e30);
+		float bestT = -1;
+		int best = -1;
+		while (true) {
+			ivec2 range = getGridCell(c.x + c.y * gridWidth);
+			for (int k = range.x; k < range.x + range.y; k++) {
+				int o = getGridSphere(k);
+				if (shadow) {
+					if (cell >= 0 && getImageCell(o) != cell) continue;
+				} else if (virtualImages == 1 && !seesImage(o, ray)) continue;
+				float t = intersectSphere(getObject(o), ray);
+				if (t > 0 && t < tMax && (bestT < 0 || t < bestT)) {
+					bestT = t;
+					best = o;
+				}
+				if (shadow && bestT > 0) return sphereHit(best, bestT, ray);
+			}
+			float tExit = min(tNext.x, tNext.y);
+			if ((bestT > 0 && bestT <= tExit) || tExit >= t1) break;	// the later cells are farther
+			if (tNext.x < tNext.y) {
+				c.x += step.x;
+				tNext.x += tDelta.x;
+			} else {
+				c.y += step.y;
+				tNext.y += tDelta.y;
+			}
+			if (c.x < 0 || c.y < 0 || c.x >= gridWidth || c.y >= gridHeight) break;
+		}
+		return best >= 0 ? sphereHit(best, bestT, ray) : hit;
+	}
+
+	Hit firstSphere(Ray ray, float tMax) {	// the closest sphere closer than tMax
+		if (rayTile >= 0) return tileIntersect(ray, tMax);
+		if (slabGrid == 1) return gridIntersect(ray, tMax, false, -1);
+		vec3 invDir = 1 / ray.dir;
+		float bestT = -1;
+		int best = -1;
+		int node = 0;
+		while (node < nNodes) {		// stackless: next node on a hit, skip node on a miss
+			vec4 lo = getNode(2 * node), hi = getNode(2 * node + 1);
+			if (!hitBox(lo.xyz, hi.xyz, ray, invDir, bestT < 0 ? tMax : bestT)) {
+				node = floatBitsToInt(lo.w);
+				continue;
+			}
+			int leaf = floatBitsToInt(hi.w);
+			for (int o = leaf / 8; o < leaf / 8 + leaf % 8; o++) {
+				if (virtualImages == 1 && !seesImage(o, ray)) continue;
+				float t = intersectSphere(getObject(o), ray);
+				if (t > 0 && t < tMax && (bestT < 0 || t < bestT)) {
+					bestT = t;
+					best = o;
+				}
+			}
+			node++;
 		}
+		Hit hit;
+		hit.t = -1;
+		return best >= 0 ? sphereHit(best, bestT, ray) : hit;
+	}
+
+	Hit firstIntersect(Ray ray) {
+		Hit bestHit = firstSphere(ray, 1e30);
+		if (virtualImages == 1) return bestHit;		// the mirrors are in the images
         for (int o = 0; o < nPlanes; o++) {
-			Hit hit = intersect(planes[o], ray); //  hit.t < 0 if no intersection
-            hit.mat = isGold? 3:4;     // half of the objects are reflective
+			Hit hit = intersectPlane(o, ray); //  hit.t < 0 if no intersection
 			if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
 		}
+		Hit hit = intersectPrism(ray);
+		if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
 		if (dot(ray.dir, bestHit.normal) > 0) bestHit.normal = bestHit.normal * (-1);
 		return bestHit;
 	}
 
-	bool shadowIntersect(Ray ray) {	// for directional lights
-		for (int o = 0; o < nObjects; o++) if (intersect(objects[o], ray).t > 0) return true;
-        for (int o = 0; o < nPlanes; o++) if (intersect(planes[o], ray).t > 0) return true;//  hit.t < 0 if no intersection
+	// for directional lights, cell >= 0: only the images in that cell cast shadows, spheres false: only the mirrors are tested
+	bool shadowIntersect(Ray ray, int cell, bool spheres) {
+		vec3 invDir = 1 / ray.dir;
+		int node = (slabGrid == 1 || !spheres) ? nNodes : 0;
+		if (spheres && slabGrid == 1 && gridIntersect(ray, 1e30, true, cell).t > 0) return true;
+		while (node < nNodes) {		// any hit ends the walk
+			vec4 lo = getNode(2 * node), hi = getNode(2 * node + 1);
+			if (!hitBox(lo.xyz, hi.xyz, ray, invDir, 1e30)) {
+				node = floatBitsToInt(lo.w);
+				continue;
+			}
+			int leaf = floatBitsToInt(hi.w);
+			for (int o = leaf / 8; o < leaf / 8 + leaf % 8; o++) {
+				if (cell >= 0 && getImageCell(o) != cell) continue;
+				if (intersectSphere(getObject(o), ray) > 0) return true;
+			}
+			node++;
+		}
+		if (cell >= 0) return false;
+        for (int o = 0; o < nPlanes; o++) if (intersectPlane(o, ray).t > 0) return true;//  hit.t < 0 if no intersection
+		if (intersectPrism(ray).t > 0) return true;
 		return false;
 	}
 
@@ -135,45 +318,610 @@ const char *fragmentSource = R"(
         return returnvec;
 	}
 
-	const float epsilon = 0.0001f;
-	const int maxdepth = 10;
+	float random(int d) {	// white noise per pixel, bounce and frame
+		uint h = uint(pixel.x) * 1973u + uint(pixel.y) * 9277u + uint(d) * 26699u + uint(frameSeed) * 7919u;
+		h = (h ^ 61u) ^ (h >> 16);
+		h *= 9u;
+		h ^= h >> 4;
+		h *= 0x27d4eb2du;
+		h ^= h >> 15;
+		return float(h) / 4294967296.0;
+	}
+
+	// 0 if the path of this weight ends before bounce d, else the factor keeping the roulette unbiased
+	float survival(vec3 weight, int d) {
+		float w = max(weight.r, max(weight.g, weight.b));
+		if (w < minWeight) return 0.0;
+		if (w >= rouletteWeight) return 1.0;
+		float p = w / rouletteWeight;
+		return random(d) < p ? 1 / p : 0;
+	}
+
+	// 1 if a sphere is in the way of the light from p on sphere slot object, -1 if none, 0 if the map can not tell: p is
+	// below the top of another sphere touching its texel, but no sphere covering the whole texel is entirely above p
+	int shadowLookup(vec3 p, int object) {
+		ivec2 texel = ivec2(floor((vec2(dot(p, shadowU), dot(p, shadowV)) - shadowBox.xy) / shadowBox.zw));
+		if (texel.x < 0 || texel.y < 0 || texel.x >= shadowWidth || texel.y >= shadowHeight) return -1;
+		vec4 bounds = getShadowTexel(texel.x + texel.y * shadowWidth);
+		float h = dot(p, shadowW);
+		if (h > (int(bounds.y) == object ? bounds.z : bounds.x)) return -1;
+		if (h < bounds.w) return 1;
+		return 0;
+	}
+
+	vec3 directLight(Hit hit, Ray ray, int cell) {	// of a rough surface, cell < 0 in the real scene
+		vec3 radiance = materials[hit.mat].ka * light.La;
+		Ray shadowRay;
+		shadowRay.start = hit.position + hit.normal * epsilon;
+		shadowRay.dir = light.direction;
+		float cosTheta = dot(hit.normal, light.direction);
+		int mapped = (cosTheta > 0 && cell < 0 && shadowMap == 1) ? shadowLookup(shadowRay.start, hit.object) : 0;
+		if (cosTheta > 0 && mapped != 1 && !shadowIntersect(shadowRay, cell, mapped == 0)) {
+			radiance += light.Le * materials[hit.mat].kd * cosTheta;
+			vec3 halfway = normalize(-ray.dir + light.direction);
+			float cosDelta = dot(hit.normal, halfway);
+			if (cosDelta > 0) radiance += light.Le * materials[hit.mat].ks * pow(cosDelta, materials[hit.mat].shininess);
+		}
+		return radiance;
+	}
+)";
+// fragment shader in GLSL
+//Frenel snis knyv 120. o
+//Vik wiki-s helper doksi
+// The #version line and traceSource come first, see fragmentVariant, the wavefront programs are built from this source
+// with WAVEFRONT defined
+const char *fragmentSource = R"(
+	// spheres and planes are in texture buffers, their number is only limited by GPU memory
+	uniform samplerBuffer objects;			// vec4(center, radius) of sphere o at objectBase + o in BVH order, written through a ring buffer
+	uniform isamplerBuffer objectMaterials;	// material index of sphere o
+	uniform samplerBuffer planes;			// vec4(normal, material index) and vec4(point, 0) of plane o at 2o and 2o + 1
+	uniform samplerBuffer bvhNodes;			// depth first BVH over the spheres, vec4(lo, skip) and vec4(hi, first * 8 + count) per node
+	uniform samplerBuffer imageInfo;		// vec4(Fresnel weight, cell) of the image in BVH slot o
+	uniform samplerBuffer cells;			// vec4(u0, u1) and vec4(entry facet normal, offset, 0) of each unfolded copy of the prism
+	uniform int pathCache;					// 1: the mirror path of each pixel is read from the cache
+	uniform isamplerBuffer pathIndex;		// first segment and segment count of pixel x + y * pathWidth
+	uniform samplerBuffer paths;			// vec4(start, t of the mirror or 1e30), vec4(dir, 0) and vec4(weight, 0) per segment
+	uniform int pathWidth;
+	uniform isamplerBuffer gridCells;		// first and count in gridSpheres of cell x + y * gridWidth
+	uniform isamplerBuffer gridSpheres;		// BVH slots of the spheres overlapping the cells
+	uniform samplerBuffer shadowTexels;		// vec4(highest top, its slot, second highest top, highest bottom of a sphere covering the texel)
+	uniform int tracedParity;				// -1: every pixel, else only those with (x + y) % 2 == tracedParity, packed in half width
+	uniform samplerBuffer motion;			// vec4(displacement since the last frame, 0) of the sphere in BVH slot o
+	uniform int tileSize;					// in pixels of the render target
+	uniform isamplerBuffer tiles;			// first and count in tileSpheres of tile x + y * tileColumns
+	uniform isamplerBuffer tileSpheres;		// BVH slots of the spheres of each tile, by the depth of their nearest point
+
+	in  vec2 cCamWindow;		// camera window coordinates of the pixel
+#if !defined(WAVEFRONT)
+	out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
+	layout(location = 1) out vec4 fragmentMotion;	// of the checkerboard frames: the screen motion of the pixel in pixels
+#endif
+
+	vec4 getObject(int o) { return texelFetch(objects, objectBase + o); }
+	int getObjectMaterial(int o) { return texelFetch(objectMaterials, o).x; }
+	vec4 getPlane(int i) { return texelFetch(planes, i); }
+	vec4 getNode(int i) { return texelFetch(bvhNodes, nodeBase + i); }
+	ivec2 getGridCell(int c) { return texelFetch(gridCells, c).xy; }
+	int getGridSphere(int k) { return texelFetch(gridSpheres, k).x; }
+	vec4 getShadowTexel(int i) { return texelFetch(shadowTexels, i); }
+	int getImageCell(int o) { return int(texelFetch(imageInfo, o).w); }
+
+	// The eye ray reaches the cell of the image through its chain of facets: its 2D direction is between u0 and u1,
+	// and it crosses the last facet inside the tube, the earlier ones are then inside too
+	bool seesImage(int o, Ray ray) {
+		int cell = int(texelFetch(imageInfo, o).w);
+		if (cell == 0) return true;
+		vec4 window = texelFetch(cells, 2 * cell), portal = texelFetch(cells, 2 * cell + 1);
+		vec2 d = ray.dir.xy;
+		if (window.x * d.y - window.y * d.x < 0 || d.x * window.w - d.y * window.z < 0) return false;
+		float z = ray.start.z + ray.dir.z * (portal.z - dot(portal.xy, ray.start.xy)) / dot(portal.xy, d);
+		return z >= prism.zMin && z <= prism.zMax;
+	}
+
+	// The eye ray against the spheres of its tile. They come nearest first, so the walk ends at the first sphere that
+	// can not be closer than the best hit or tMax: no point of it is nearer along a ray from the eye than its depth.
+	Hit tileIntersect(Ray ray, float tMax) {
+		vec3 forward = normalize(wLookAt - wEye);
+		float bestT = -1;
+		int best = -1;
+		ivec2 range = texelFetch(tiles, rayTile).xy;
+		for (int k = range.x; k < range.x + range.y; k++) {
+			int o = texelFetch(tileSpheres, k).x;
+			vec4 sphere = getObject(o);
+			if (dot(sphere.xyz - ray.start, forward) - sphere.w >= (bestT < 0 ? tMax : bestT)) break;
+			if (virtualImages == 1 && !seesImage(o, ray)) continue;
+			float t = intersectSphere(sphere, ray);
+			if (t > 0 && t < tMax && (bestT < 0 || t < bestT)) {
+				bestT = t;
+				best = o;
+			}
+		}
+		Hit hit;
+		hit.t = -1;
+		return best >= 0 ? sphereHit(best, bestT, ray) : hit;
+	}
+
+	vec3 seenPoint;						// of the sphere seen in the pixel, unfolded by the mirrors into the space of the eye ray
+	vec3 seenMotion = vec3(0, 0, 0);	// its displacement since the last frame, unfolded too, 0 for the sky
+
+	void see(vec3 point, mat3 unfold, int object) {		// the mirrors so far are in unfold
+		seenPoint = point;
+		if (tracedParity >= 0) seenMotion = unfold * texelFetch(motion, object).xyz;
+	}
+
+	mat3 mirror(vec3 normal) { return mat3(1) - 2 * outerProduct(normal, normal); }
 
 	vec3 trace(Ray ray) {
 		vec3 weight = vec3(1, 1, 1);
 		vec3 outRadiance = vec3(0, 0, 0);
-		for(int d = 0; d < maxdepth; d++) {
+		vec3 eyeDir = ray.dir;
+		float pathLength = 0;
+		mat3 unfold = mat3(1);
+		for(int d = 0; d < depthCap; d++) {
+			bounces = d + 1;
 			Hit hit = firstIntersect(ray);
+			rayTile = -1;
 			if (hit.t < 0) return weight * light.La;
-			if (materials[hit.mat].rough == 1) {
-				outRadiance += weight * materials[hit.mat].ka * light.La;
-				Ray shadowRay;
-				shadowRay.start = hit.position + hit.normal * epsilon;
-				shadowRay.dir = light.direction;
-				float cosTheta = dot(hit.normal, light.direction);
-				if (cosTheta > 0 && !shadowIntersect(shadowRay)) {
-					outRadiance += weight * light.Le * materials[hit.mat].kd * cosTheta;
-					vec3 halfway = normalize(-ray.dir + light.direction);
-					float cosDelta = dot(hit.normal, halfway);
-					if (cosDelta > 0) outRadiance += weight * light.Le * materials[hit.mat].ks * pow(cosDelta, materials[hit.mat].shininess);
-				}
+			if (materials[hit.mat].rough == 1) outRadiance += weight * directLight(hit, ray, -1);
+			pathLength += hit.t;
+
+			if (materials[hit.mat].reflective == 1) {
+				weight *= Fresnel(materials[hit.mat].v, materials[hit.mat].k, dot(-ray.dir, hit.normal));
+				float s = survival(weight, d + 1);
+				if (s == 0) return outRadiance;
+				weight *= s;
+				ray.start = hit.position + hit.normal * epsilon;
+				ray.dir = reflect(ray.dir, hit.normal);
+				unfold = unfold * mirror(hit.normal);
+			} else {		// a sphere
+				see(wEye + eyeDir * pathLength, unfold, hit.object);
+				return outRadiance;
+			}
+		}
+		return outRadiance;
+	}
+
+	// One eye ray against the mirror images of the spheres. The light is parallel to the mirrors, so it is the same in
+	// every image. Only the sky needs the bounces, without any sphere tests.
+	vec3 traceImages(Ray ray) {
+		bounces = 1;
+		Hit hit = firstIntersect(ray);
+		if (hit.t > 0) {
+			see(hit.position, mat3(1), hit.object);		// the images are unfolded already
+			vec4 info = texelFetch(imageInfo, hit.object);
+			return info.rgb * directLight(hit, ray, int(info.w));
+		}
+		vec3 weight = vec3(1, 1, 1);
+		for (int d = 0; d < depthCap; d++) {
+			bounces = d + 1;
+			hit = intersectPrism(ray);
+			if (hit.t < 0) return weight * light.La;
+			if (dot(ray.dir, hit.normal) > 0) hit.normal = hit.normal * (-1);
+			weight *= Fresnel(materials[prism.mat].v, materials[prism.mat].k, dot(-ray.dir, hit.normal));
+			float s = survival(weight, d + 1);
+			if (s == 0) return vec3(0, 0, 0);
+			weight *= s;
+			ray.start = hit.position + hit.normal * epsilon;
+			ray.dir = reflect(ray.dir, hit.normal);
+		}
+		return vec3(0, 0, 0);
+	}
+
+	// The mirror path of the pixel does not change while the spheres move, only the spheres are tested along its
+	// cached segments. The spheres are rough, the path ends on them.
+	vec3 traceCached() {
+		ivec2 index = texelFetch(pathIndex, pixel.y * pathWidth + pixel.x).xy;
+		float scale = 1;		// of the roulette
+		vec3 eyeDir = texelFetch(paths, 3 * index.x + 1).xyz, lastDir = eyeDir;
+		float pathLength = 0;
+		mat3 unfold = mat3(1);
+		for (int k = 0; k < min(index.y, depthCap); k++) {
+			int segment = 3 * (index.x + k);
+			vec4 start = texelFetch(paths, segment);
+			Ray ray;
+			ray.start = start.xyz;
+			ray.dir = texelFetch(paths, segment + 1).xyz;
+			if (k > 0) unfold = unfold * mirror(normalize(ray.dir - lastDir));	// the mirror between the segments
+			lastDir = ray.dir;
+			vec3 weight = texelFetch(paths, segment + 2).rgb * scale;
+			if (k > 0) {
+				float s = survival(weight, k);
+				if (s == 0) return vec3(0, 0, 0);
+				scale *= s;
+				weight *= s;
+			}
+			bounces = k + 1;
+			Hit hit = firstSphere(ray, start.w);
+			rayTile = -1;
+			if (hit.t > 0) {
+				if (dot(ray.dir, hit.normal) > 0) hit.normal = hit.normal * (-1);
+				see(wEye + eyeDir * (pathLength + hit.t), unfold, hit.object);
+				return weight * directLight(hit, ray, -1);
 			}
+			if (start.w >= 1e30) return weight * light.La;
+			pathLength += start.w;
+		}
+		return vec3(0, 0, 0);
+	}
+
+	vec2 project(vec3 point) {	// to camera window coordinates
+		vec3 forward = wLookAt - wEye, toPoint = point - wEye;
+		vec3 q = toPoint * (dot(forward, forward) / dot(toPoint, forward)) - forward;
+		return vec2(dot(q, wRight) / dot(wRight, wRight), dot(q, wUp) / dot(wUp, wUp));
+	}
 
+#if defined(WAVEFRONT)
+	// The wavefront tracer runs the loop of trace() as full screen passes, an intersect and a shade pass per bounce, so
+	// the fragments of a pass all do the same work. Its two programs are built from this source, each with only the
+	// samplers it reads: WAVEFRONT 1 intersects, WAVEFRONT 2 writes the eye rays and shades. The ray state is
+	// vec4(start, record), vec4(dir, 0), vec4(weight, 0) and vec4(radiance, 0). The record counts the passes that wrote
+	// the ray, negative once it ended. killSource takes the ended rays out of the stencil mask, resolveSource takes the
+	// latest state of a pixel from whichever of the two ping-pong buffers has the larger record. A discard anywhere in
+	// these programs would make the stencil test late.
+	uniform int bounce;						// of the intersect and shade passes
+	uniform sampler2D rayStart, rayDir;		// ray state written by the last pass
+#if WAVEFRONT == 1
+	layout(location = 0) out vec4 hitNormalOut;		// vec4(normal, t), t < 0 if the ray left the scene
+	layout(location = 1) out vec4 hitMaterialOut;	// vec4(material, slot, 0, 0)
+
+	void main() {		// intersect, the tiles only hold the eye rays
+		pixel = ivec2(gl_FragCoord.xy);
+		if (tileCulling == 1 && bounce == 0) rayTile = pixel.x / tileSize + pixel.y / tileSize * tileColumns;
+		Ray ray;
+		ray.start = texelFetch(rayStart, pixel, 0).xyz;
+		ray.dir = texelFetch(rayDir, pixel, 0).xyz;
+		Hit hit = firstIntersect(ray);
+		hitNormalOut = vec4(hit.normal, hit.t);
+		hitMaterialOut = vec4(float(hit.mat), float(hit.object), 0, 0);
+	}
+#else
+	uniform int eyePass;						// 1: the eye rays, 0: shade
+	uniform sampler2D rayWeight, rayRadiance;
+	uniform sampler2D hitNormal, hitMaterial;	// written by the intersect pass
+	layout(location = 0) out vec4 rayStartOut;
+	layout(location = 1) out vec4 rayDirOut;
+	layout(location = 2) out vec4 rayWeightOut;
+	layout(location = 3) out vec4 rayRadianceOut;
+
+	void main() {
+		pixel = ivec2(gl_FragCoord.xy);
+		if (eyePass == 1) {
+			vec2 cCam = cCamWindow + jitter * 2 / vec2(textureSize(accumulation, 0));
+			vec3 p = wLookAt + wRight * cCam.x + wUp * cCam.y;
+			rayStartOut = vec4(wEye, 1);
+			rayDirOut = vec4(normalize(p - wEye), 0);
+			rayWeightOut = vec4(1, 1, 1, 0);
+			rayRadianceOut = vec4(0, 0, 0, 0);
+			return;
+		}
+		vec4 start = texelFetch(rayStart, pixel, 0);
+		Ray ray;
+		ray.start = start.xyz;
+		ray.dir = texelFetch(rayDir, pixel, 0).xyz;
+		vec3 weight = texelFetch(rayWeight, pixel, 0).rgb, radiance = texelFetch(rayRadiance, pixel, 0).rgb;
+		vec4 normal = texelFetch(hitNormal, pixel, 0);
+		bool alive = false;
+		if (normal.w < 0) radiance += weight * light.La;
+		else {
+			vec4 material = texelFetch(hitMaterial, pixel, 0);
+			Hit hit;
+			hit.t = normal.w;
+			hit.position = ray.start + ray.dir * hit.t;
+			hit.normal = normal.xyz;
+			hit.mat = int(material.x);
+			hit.object = int(material.y);
+			if (materials[hit.mat].rough == 1) radiance += weight * directLight(hit, ray, -1);
 			if (materials[hit.mat].reflective == 1) {
 				weight *= Fresnel(materials[hit.mat].v, materials[hit.mat].k, dot(-ray.dir, hit.normal));
+				float s = survival(weight, bounce + 1);
+				weight *= s;
+				alive = s > 0 && bounce + 1 < depthCap;
 				ray.start = hit.position + hit.normal * epsilon;
 				ray.dir = reflect(ray.dir, hit.normal);
-			} else return outRadiance;
+			}
+		}
+		float record = abs(start.w) + 1;
+		rayStartOut = vec4(ray.start, alive ? record : -record);
+		rayDirOut = vec4(ray.dir, 0);
+		rayWeightOut = vec4(weight, 0);
+		rayRadianceOut = vec4(radiance, 0);
+	}
+#endif
+#else
+	void main() {
+		ivec2 size = textureSize(accumulation, 0);
+		pixel = ivec2(gl_FragCoord.xy);
+		vec2 cCam = cCamWindow;
+		if (tracedParity >= 0) {	// dense, a discard per pixel would leave half of each SIMD group idle
+			pixel.x = min(2 * pixel.x + ((pixel.y + tracedParity) & 1), size.x - 1);	// past an odd width: not read
+			cCam = (vec2(pixel) + 0.5) * 2 / vec2(size) - 1;
+		}
+		cCam += jitter * 2 / vec2(size);
+		if (tileCulling == 1) rayTile = pixel.x / tileSize + pixel.y / tileSize * tileColumns;
+		vec3 p = wLookAt + wRight * cCam.x + wUp * cCam.y;	// point on camera window corresponding to the pixel
+		Ray ray;
+		ray.start = wEye;
+		ray.dir = normalize(p - wEye);
+		if (virtualImages == 1) fragmentColor = vec4(traceImages(ray), 1);
+		else if (pathCache == 1 && sampleIndex == 0) fragmentColor = vec4(traceCached(), 1);	// cached for the pixel center only
+		else fragmentColor = vec4(trace(ray), 1);
+		if (bounceView == 1) {	// blue: one segment, red: maxdepth
+			float t = float(bounces - 1) / float(maxdepth - 1);
+			fragmentColor = vec4(t, 1 - abs(2 * t - 1), 1 - t, 1);
+		}
+		if (sampleIndex > 0) fragmentColor = mix(texelFetch(accumulation, pixel, 0), fragmentColor, 1.0 / float(sampleIndex + 1));
+		fragmentMotion = vec4(0, 0, 0, 0);
+		if (seenMotion != vec3(0, 0, 0)) {
+			fragmentMotion.xy = (project(seenPoint) - project(seenPoint - seenMotion)) * vec2(size) / 2;
+		}
+	}
+#endif
+)";
+// Takes the rays that ended in the last shade pass of the wavefront tracer out of the stencil mask
+const char *killSource = R"(
+	#version 330
+    precision highp float;
+
+	uniform sampler2D rayStart;		// the record in w is negative once the ray ended
+
+	out vec4 fragmentColor;
+
+	void main() {
+		if (texelFetch(rayStart, ivec2(gl_FragCoord.xy), 0).w > 0) discard;
+		fragmentColor = vec4(0, 0, 0, 0);
+	}
+)";
+// The last pass of the wavefront tracer: the radiance of each pixel from the ray state buffer that wrote it last, into
+// the accumulation target as the main program writes it
+const char *resolveSource = R"(
+	#version 330
+    precision highp float;
+
+	uniform sampler2D rayStart, rayRadiance;		// of one ray state buffer, the record in w counts the passes
+	uniform sampler2D otherStart, otherRadiance;	// of the other one
+	uniform sampler2D accumulation;
+	uniform int sampleIndex;
+	uniform int bounceView;
+
+	out vec4 fragmentColor;
+
+	const int maxdepth = 10;
+
+	void main() {
+		ivec2 pixel = ivec2(gl_FragCoord.xy);
+		float record = texelFetch(rayStart, pixel, 0).w, otherRecord = texelFetch(otherStart, pixel, 0).w;
+		vec3 radiance = abs(otherRecord) > abs(record) ? texelFetch(otherRadiance, pixel, 0).rgb : texelFetch(rayRadiance, pixel, 0).rgb;
+		fragmentColor = vec4(radiance, 1);
+		if (bounceView == 1) {
+			int bounces = int(max(abs(record), abs(otherRecord))) - 1;
+			float t = float(bounces - 1) / float(maxdepth - 1);
+			fragmentColor = vec4(t, 1 - abs(2 * t - 1), 1 - t, 1);
+		}
+		if (sampleIndex > 0) fragmentColor = mix(texelFetch(accumulation, pixel, 0), fragmentColor, 1.0 / float(sampleIndex + 1));
+	}
+)";
+// Fills the pixels a checkerboard frame skipped: the previous frame is read where the traced neighbor of the largest
+// motion came from, and clamped into the colors of the four traced neighbors against ghosts of disocclusion
+const char *reconstructSource = R"(
+	#version 330
+    precision highp float;
+
+	uniform sampler2D traced;			// color and motion of this frame, pixel (x, y) of tracedParity at (x / 2, y)
+	uniform sampler2D tracedMotion;
+	uniform sampler2D previous;			// the last full frame
+	uniform int tracedParity;
+
+	out vec4 fragmentColor;
+
+	void main() {
+		ivec2 pixel = ivec2(gl_FragCoord.xy), size = textureSize(previous, 0);
+		if (((pixel.x + pixel.y) & 1) == tracedParity) {
+			fragmentColor = texelFetch(traced, ivec2(pixel.x / 2, pixel.y), 0);
+			return;
+		}
+		vec4 lo = vec4(1e30), hi = vec4(-1e30);
+		vec2 motion = vec2(0, 0);
+		ivec2 offsets[4] = ivec2[4](ivec2(1, 0), ivec2(-1, 0), ivec2(0, 1), ivec2(0, -1));
+		for (int k = 0; k < 4; k++) {
+			ivec2 neighbor = pixel + offsets[k];
+			if (any(lessThan(neighbor, ivec2(0))) || any(greaterThanEqual(neighbor, size))) neighbor = pixel - offsets[k];	// same parity
+			neighbor.x /= 2;
+			vec4 color = texelFetch(traced, neighbor, 0);
+			lo = min(lo, color);
+			hi = max(hi, color);
+			vec2 m = texelFetch(tracedMotion, neighbor, 0).xy;
+			if (dot(m, m) > dot(motion, motion)) motion = m;
+		}
+		fragmentColor = clamp(texture(previous, (gl_FragCoord.xy - motion) / vec2(size)), lo, hi);
+	}
+)";
+// The compute backend, GL 4.3 or its extensions, computeShaderHeader and traceSource come first, see computeVariant:
+// the plain trace() of the fragment shader with the scene in shader storage blocks. A work group is a screen tile of
+// Scene::tileSize, its eye rays share the sphere list of the tile in shared memory. The rays leaving a mirror go into a
+// queue, which persistent threads drain in a second dispatch. The virtual images, the path cache and the checkerboard
+// frames stay in the fragment shader.
+const char *computeSource = R"(
+	layout(local_size_x = 16, local_size_y = 16) in;
+
+	// the buffers of the texture buffers of the fragment shader
+	layout(std430, binding = 0) readonly buffer Objects { vec4 objects[]; };	// vec4(center, radius) of slot o at objectBase + o
+	layout(std430, binding = 1) readonly buffer Nodes { vec4 bvhNodes[]; };	// vec4(lo, skip), vec4(hi, first * 8 + count) at nodeBase
+	layout(std430, binding = 2) readonly buffer ObjectMaterials { int objectMaterials[]; };
+	layout(std430, binding = 3) readonly buffer Planes { vec4 planes[]; };
+	layout(std430, binding = 4) readonly buffer Tiles { ivec2 tiles[]; };
+	layout(std430, binding = 5) readonly buffer TileSpheres { int tileSpheres[]; };
+	layout(std430, binding = 7) readonly buffer GridCells { ivec2 gridCells[]; };
+	layout(std430, binding = 8) readonly buffer GridSpheres { int gridSpheres[]; };
+	layout(std430, binding = 9) readonly buffer ShadowTexels { vec4 shadowTexels[]; };
+
+	struct QueuedRay {		// a path after its first mirror
+		vec4 start, dir, weight, radiance;
+		ivec4 pixel;		// x, y and the bounces so far
+	};
+	layout(std430, binding = 6) buffer RayQueue {
+		uint queueCount;	// pushed by the eye rays
+		uint queueHead;		// next one to take
+		QueuedRay queue[];
+	};
+
+	layout(rgba32f, binding = 0) writeonly uniform image2D image;
+	uniform int computePass;				// 0: eye rays by tiles, 1: the queue
+
+	const int cacheSize = 256;				// one sphere per invocation, the rest of a longer list is read from Objects
+	shared vec4 cachedSpheres[cacheSize];	// of the tile of the work group, nearest first
+	shared int cachedSlots[cacheSize];
+	shared uint batchStart;					// of the queued rays the work group traces next, a ray per invocation
+	int tileFirst = 0, tileCount = 0;		// the list of the tile of the work group
+
+	vec4 getObject(int o) { return objects[objectBase + o]; }
+	int getObjectMaterial(int o) { return objectMaterials[o]; }
+	vec4 getPlane(int i) { return planes[i]; }
+	vec4 getNode(int i) { return bvhNodes[nodeBase + i]; }
+	ivec2 getGridCell(int c) { return gridCells[c]; }
+	int getGridSphere(int k) { return gridSpheres[k]; }
+	vec4 getShadowTexel(int i) { return shadowTexels[i]; }
+	bool seesImage(int o, Ray ray) { return true; }		// virtualImages is 0, the images stay in the fragment shader
+	int getImageCell(int o) { return -1; }
+
+	// The eye ray against the spheres of its tile, as tileIntersect of the fragment shader, the first ones from shared memory
+	Hit tileIntersect(Ray ray, float tMax) {
+		vec3 forward = normalize(wLookAt - wEye);
+		float bestT = -1;
+		int best = -1;
+		for (int k = 0; k < tileCount; k++) {
+			int o = k < cacheSize ? cachedSlots[k] : tileSpheres[tileFirst + k];
+			vec4 sphere = k < cacheSize ? cachedSpheres[k] : getObject(o);
+			if (dot(sphere.xyz - ray.start, forward) - sphere.w >= (bestT < 0 ? tMax : bestT)) break;
+			float t = intersectSphere(sphere, ray);
+			if (t > 0 && t < tMax && (bestT < 0 || t < bestT)) {
+				bestT = t;
+				best = o;
+			}
+		}
+		Hit hit;
+		hit.t = -1;
+		return best >= 0 ? sphereHit(best, bestT, ray) : hit;
+	}
+
+	// bounces [first, last) of the loop of trace() in the fragment shader, true if the path goes on after them
+	bool trace(inout Ray ray, inout vec3 weight, inout vec3 radiance, int first, int last) {
+		for (int d = first; d < last; d++) {
+			bounces = d + 1;
+			Hit hit = firstIntersect(ray);
+			rayTile = -1;
+			if (hit.t < 0) {
+				radiance = weight * light.La;
+				return false;
+			}
+			if (materials[hit.mat].rough == 1) radiance += weight * directLight(hit, ray, -1);
+			if (materials[hit.mat].reflective != 1) return false;
+			weight *= Fresnel(materials[hit.mat].v, materials[hit.mat].k, dot(-ray.dir, hit.normal));
+			float s = survival(weight, d + 1);
+			if (s == 0) return false;
+			weight *= s;
+			ray.start = hit.position + hit.normal * epsilon;
+			ray.dir = reflect(ray.dir, hit.normal);
+		}
+		return last < depthCap;
+	}
+
+	void writePixel(vec3 radiance) {
+		vec4 color = vec4(radiance, 1);
+		if (bounceView == 1) {
+			float t = float(bounces - 1) / float(maxdepth - 1);
+			color = vec4(t, 1 - abs(2 * t - 1), 1 - t, 1);
 		}
+		if (sampleIndex > 0) color = mix(texelFetch(accumulation, pixel, 0), color, 1.0 / float(sampleIndex + 1));
+		imageStore(image, pixel, color);
 	}
 
 	void main() {
+		if (computePass == 1) {		// persistent threads: the work group takes batches of rays until the queue is empty
+			// Every invocation runs every iteration and meets both barriers, the loop ends for the whole group at once:
+			// start comes from shared memory and count was written by the eye ray dispatch. Only the tracing is skipped.
+			uint count = queueCount;
+			while (true) {
+				if (gl_LocalInvocationIndex == 0u) batchStart = atomicAdd(queueHead, uint(cacheSize));
+				barrier();
+				uint start = batchStart;
+				barrier();			// all have read batchStart before the next atomicAdd overwrites it
+				if (start >= count) break;
+				uint i = start + gl_LocalInvocationIndex;
+				bool hasRay = i < count;
+				if (hasRay) {
+					Ray ray;
+					ray.start = queue[i].start.xyz;
+					ray.dir = queue[i].dir.xyz;
+					vec3 weight = queue[i].weight.rgb, radiance = queue[i].radiance.rgb;
+					pixel = queue[i].pixel.xy;
+					trace(ray, weight, radiance, queue[i].pixel.z, depthCap);
+					writePixel(radiance);
+				}
+			}
+			return;
+		}
+
+		if (tileCulling == 1) {		// the work group loads the list of its tile
+			ivec2 range = tiles[gl_WorkGroupID.x + gl_WorkGroupID.y * uint(tileColumns)];
+			int k = int(gl_LocalInvocationIndex);
+			if (k < min(range.y, cacheSize)) {
+				cachedSlots[k] = tileSpheres[range.x + k];
+				cachedSpheres[k] = getObject(cachedSlots[k]);
+			}
+			tileFirst = range.x;
+			tileCount = range.y;
+			rayTile = int(gl_WorkGroupID.x + gl_WorkGroupID.y * uint(tileColumns));
+		}
+		barrier();
+		ivec2 size = imageSize(image);
+		pixel = ivec2(gl_GlobalInvocationID.xy);
+		if (pixel.x >= size.x || pixel.y >= size.y) return;
+		vec2 cCam = (vec2(pixel) + 0.5) * 2 / vec2(size) - 1 + jitter * 2 / vec2(size);
+		vec3 p = wLookAt + wRight * cCam.x + wUp * cCam.y;
 		Ray ray;
 		ray.start = wEye;
 		ray.dir = normalize(p - wEye);
-		fragmentColor = vec4(trace(ray), 1);
+		vec3 weight = vec3(1, 1, 1), radiance = vec3(0, 0, 0);
+		if (!trace(ray, weight, radiance, 0, 1)) {
+			writePixel(radiance);
+			return;
+		}
+		uint i = atomicAdd(queueCount, 1u);
+		queue[i].start = vec4(ray.start, 0);
+		queue[i].dir = vec4(ray.dir, 0);
+		queue[i].weight = vec4(weight, 0);
+		queue[i].radiance = vec4(radiance, 0);
+		queue[i].pixel = ivec4(pixel, 1, 0);
 	}
 )";
 float rnd() { return (float)rand() / RAND_MAX; };
+float halton(int index, int base) {     // radical inverse of index, a low discrepancy sequence in [0, 1)
+    float f = 1, r = 0;
+    for (int i = index; i > 0; i /= base) {
+        f /= base;
+        r += f * (i % base);
+    }
+    return r;
+}
+
+// std140 mirror of SceneBlock: a vec3 takes 16 bytes unless a 4 byte member follows it, structs are padded to 16
+struct LightData { vec3 direction; float pad0; vec3 Le; float pad1; vec3 La; float pad2; };
+struct MaterialData { vec3 ka; float pad0; vec3 kd; float pad1; vec3 ks; float shininess; vec3 k; float pad2; vec3 v; int rough, reflective; int pad3[3]; };
+struct PrismData { int nSides; float apothem, zMin, zMax; float rotation; int material; int pad[2]; };
+struct SceneData {
+    vec3 wEye;
+    int nObjects;
+    vec3 wLookAt;
+    int nPlanes;
+    vec3 wRight;
+    float pad0;
+    vec3 wUp;
+    float pad1;
+    LightData light;
+    MaterialData materials[5];
+    PrismData prism;
+};
+static_assert(sizeof(MaterialData) == 96 && sizeof(PrismData) == 32 && sizeof(SceneData) == 624, "SceneData must follow std140");
 class Material {
 protected:
     vec3 ka, kd, ks;
@@ -189,28 +937,21 @@ public:
         rough = true;
         reflective = false;
     }
-    void SetUniform(unsigned int shaderProg, int mat) {
-        char buffer[256];
-        sprintf(buffer, "materials[%d].ka", mat);
-        ka.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "materials[%d].kd", mat);
-        kd.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "materials[%d].ks", mat);
-        ks.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "materials[%d].shininess", mat);
-        int location = glGetUniformLocation(shaderProg, buffer);
-        if (location >= 0) glUniform1f(location, shininess); else printf("uniform material.shininess cannot be set\n");
-        sprintf(buffer, "materials[%d].k", mat);
-        k.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "materials[%d].v", mat);
-        v.SetUniform(shaderProg, buffer);
-
-        sprintf(buffer, "materials[%d].rough", mat);
-        location = glGetUniformLocation(shaderProg, buffer);
-        if (location >= 0) glUniform1i(location, rough ? 1 : 0); else printf("uniform material.rough cannot be set\n");
-        sprintf(buffer, "materials[%d].reflective", mat);
-        location = glGetUniformLocation(shaderProg, buffer);
-        if (location >= 0) glUniform1i(location, reflective ? 1 : 0); else printf("uniform material.reflective cannot be set\n");
+    vec3 Fresnel(float cosTheta) const {    // the formula of the shader
+        float c = powf(1 - cosTheta, 5);
+        return vec3(((v.x - 1) * (v.x - 1) + k.x * k.x + c * 4 * v.x) / ((v.x + 1) * (v.x + 1) + k.x * k.x),
+                    ((v.y - 1) * (v.y - 1) + k.y * k.y + c * 4 * v.y) / ((v.y + 1) * (v.y + 1) + k.y * k.y),
+                    ((v.z - 1) * (v.z - 1) + k.z * k.z + c * 4 * v.z) / ((v.z + 1) * (v.z + 1) + k.z * k.z));
+    }
+    void Pack(MaterialData& d) const {
+        d.ka = ka;
+        d.kd = kd;
+        d.ks = ks;
+        d.shininess = shininess;
+        d.k = k;
+        d.v = v;
+        d.rough = rough ? 1 : 0;
+        d.reflective = reflective ? 1 : 0;
     }
 };
 
@@ -240,16 +981,10 @@ struct Sphere {
     vec3 force;
     vec3 center;
     float radius;
+    int material;
 
-    Sphere(const vec3& _center, float _radius) { center = _center; radius = _radius; force = vec3(rnd()*0.001, rnd()*0.001, 0);}
-    void SetUniform(unsigned int shaderProg, int o) {
-        char buffer[256];
-        sprintf(buffer, "objects[%d].center", o);
-        center.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "objects[%d].radius", o);
-        int location = glGetUniformLocation(shaderProg, buffer);
-        if (location >= 0) glUniform1f(location, radius); else printf("uniform %s cannot be set\n", buffer);
-    }
+    Sphere(const vec3& _center, float _radius, int _material) { center = _center; radius = _radius; material = _material; force = vec3(rnd()*0.001, rnd()*0.001, 0);}
+    vec4 texel() const { return vec4(center.x, center.y, center.z, radius); }
     bool collide(Sphere s){
         return length(center-s.center) <= (radius+s.radius) && dot(center-s.center,force ) < 0? true: false;
     }
@@ -263,37 +998,168 @@ struct Sphere {
 struct Plane{
     vec3 normal;
     vec3 point;
-    Plane(const vec3 & _normal, const vec3 & _point){normal = _normal; point = _point;}
-    void SetUniform(unsigned int shaderProg, int o) {
-        char buffer[256];
-        sprintf(buffer, "planes[%d].normal", o);
-        normal.SetUniform(shaderProg, buffer);
-        sprintf(buffer, "planes[%d].point", o);
-        point.SetUniform(shaderProg, buffer);
+    int material;
+    Plane(const vec3 & _normal, const vec3 & _point, int _material){normal = _normal; point = _point; material = _material;}
+    void Pack(vec4& normalTexel, vec4& pointTexel) const {
+        normalTexel = vec4(normal.x, normal.y, normal.z, (float)material);
+        pointTexel = vec4(point.x, point.y, point.z, 0);
     }
     bool collide(Sphere s){
         return dot(s.center-point, normal) <= s.radius && dot(s.force, normal*-1) >0? true: false;
     }
 
 };
+struct MirrorCell {     // unfolded copy of the prism cross section, the eye sees it through a chain of mirror facets
+    vec2 origin, ex, ey;        // p -> origin + ex * p.x + ey * p.y maps the prism onto the copy
+    vec2 u0, u1;                // the eye sees the copy between these 2D directions, counterclockwise
+    vec2 portalNormal;          // the facet the copy is entered through: dot(portalNormal, p) = portalOffset
+    float portalOffset;
+    int entry;                  // that facet of the prism, -1 for the prism itself
+    std::vector<vec3> normals;  // of the facets crossed on the way
+    MirrorCell() { origin = vec2(0, 0); ex = vec2(1, 0); ey = vec2(0, 1); portalOffset = 0; entry = -1; }
+    vec2 map(const vec2& p) const { return origin + ex * p.x + ey * p.y; }
+    vec2 mapDir(const vec2& d) const { return ex * d.x + ey * d.y; }
+    MirrorCell reflect(const vec2& n, float offset) const {    // mirrored on the line dot(n, p) = offset
+        MirrorCell cell = *this;
+        cell.origin = origin - n * (2 * (dot(n, origin) - offset));
+        cell.ex = ex - n * (2 * dot(n, ex));
+        cell.ey = ey - n * (2 * dot(n, ey));
+        return cell;
+    }
+};
+struct Prism {      // the mirror tube: nSides planes around the z axis at distance apothem, clipped to [zMin, zMax]
+    int nSides;
+    float apothem, zMin, zMax;
+    float rotation;     // angle of the outward normal of facet 0
+    int material;
+    Prism() { nSides = 0; apothem = zMin = zMax = rotation = 0; material = 0; }
+    Prism(int _nSides, float _apothem, float _zMin, float _zMax, float _rotation, int _material) {
+        nSides = _nSides; apothem = _apothem; zMin = _zMin; zMax = _zMax; rotation = _rotation; material = _material;
+    }
+    vec3 getNormal(int k) const {   // outward normal of facet k
+        float angle = rotation + k * 2 * M_PI / nSides;
+        return vec3(cosf(angle), sinf(angle), 0);
+    }
+    vec2 getVertex(int i) const {   // between facets i - 1 and i
+        float sector = 2 * M_PI / nSides, angle = rotation + (i - 0.5f) * sector, r = apothem / cosf(sector / 2);
+        return vec2(r * cosf(angle), r * sinf(angle));
+    }
+    // the copies of the cross section seen from the eye through at most depth facets, cell 0 is the prism itself
+    void buildCells(const vec2& eye, int depth, std::vector<MirrorCell>& cells) const {
+        cells.clear();
+        if (nSides >= 3) addCells(MirrorCell(), eye, depth, cells);
+    }
+    void addCells(const MirrorCell& cell, const vec2& eye, int depth, std::vector<MirrorCell>& cells) const {
+        cells.push_back(cell);
+        if ((int)cell.normals.size() >= depth) return;
+        for (int i = 0; i < nSides; i++) {
+            if (i == cell.entry) continue;
+            vec3 normal = getNormal(i);
+            vec2 n = cell.mapDir(vec2(normal.x, normal.y)), a = cell.map(getVertex(i)), b = cell.map(getVertex(i + 1));
+            if (dot(n, a - eye) <= 0) continue;     // facing the eye, rays enter the copy there
+            vec2 u0 = a - eye, u1 = b - eye;
+            if (cross(u0, u1) < 0) std::swap(u0, u1);
+            if (cell.entry >= 0) {      // seen through the window of the copy
+                if (cross(u0, cell.u0) > 0) u0 = cell.u0;
+                if (cross(cell.u1, u1) > 0) u1 = cell.u1;
+                if (cross(u0, u1) <= 0) continue;
+            }
+            MirrorCell next = cell.reflect(n, dot(n, a));
+            next.u0 = u0;
+            next.u1 = u1;
+            next.portalNormal = n;
+            next.portalOffset = dot(n, a);
+            next.entry = i;
+            next.normals.push_back(vec3(n.x, n.y, 0));
+            addCells(next, eye, depth, cells);
+        }
+    }
+    // facets [first, last] closer to the sphere center than its radius, they are within an angle of the center
+    void getFacets(const Sphere& s, int& first, int& last) const {
+        float dist = length(vec2(s.center.x, s.center.y)), sector = 2 * M_PI / nSides;
+        first = 0;
+        last = -1;
+        if (dist <= 0 || dist < apothem - s.radius) return;
+        float angle = atan2f(s.center.y, s.center.x) - rotation;
+        float reach = acosf(std::min(1.0f, (apothem - s.radius) / dist));
+        first = (int)ceilf((angle - reach) / sector);
+        last = (int)floorf((angle + reach) / sector);
+    }
+    bool collide(const Sphere& s, int k) const {    // the sphere touches facet k and moves towards it
+        vec3 n = getNormal(k);
+        return apothem - dot(s.center, n) <= s.radius && dot(s.force, n) > 0;
+    }
+    // the ray-prism intersection of the shader, t < 0 if there is none, the normal points inwards
+    float intersect(const vec3& start, const vec3& dir, vec3& normal) const {
+        if (nSides < 3) return -1;
+        float sector = 2 * M_PI / nSides, R = apothem / cosf(sector / 2);
+        vec2 s(start.x, start.y), d(dir.x, dir.y);
+        float a = dot(d, d), b = dot(s, d), c = dot(s, s) - R * R;
+        float discr = b * b - a * c;
+        if (a == 0 || discr < 0) return -1;
+        vec2 q = s + d * ((-b + sqrtf(discr)) / a);
+        float angle = rotation + roundf((atan2f(q.y, q.x) - rotation) / sector) * sector;
+        vec2 n(cosf(angle), sinf(angle));
+        float nevezo = dot(d, n);
+        if (nevezo <= 0) return -1;
+        float t = (apothem - dot(s, n)) / nevezo;
+        float z = start.z + dir.z * t;
+        if (z < zMin || z > zMax) return -1;
+        normal = vec3(-n.x, -n.y, 0);
+        return t;
+    }
+    void Pack(PrismData& d) const {
+        d.nSides = nSides;
+        d.apothem = apothem;
+        d.zMin = zMin;
+        d.zMax = zMax;
+        d.rotation = rotation;
+        d.material = material;
+    }
+};
 class Camera {
-    vec3 eye, lookat, right, up;
-    float fov;
+    vec3 eye, lookat, vup, right, up;
+    float fov;          // vertical
+    float aspect = 1;   // width / height of the window
 public:
-    void set(vec3 _eye, vec3 _lookat, vec3 vup, double _fov) {
+    void set(vec3 _eye, vec3 _lookat, vec3 _vup, double _fov) {
         eye = _eye;
         lookat = _lookat;
+        vup = _vup;
         fov = _fov;
         vec3 w = eye - lookat;
         float f = length(w);
-        right = normalize(cross(vup, w)) * f * tan(fov / 2);
+        right = normalize(cross(vup, w)) * f * tan(fov / 2) * aspect;
         up = normalize(cross(w, right)) * f * tan(fov / 2);
     }
-    void SetUniform(unsigned int shaderProg) {
-        eye.SetUniform(shaderProg, "wEye");
-        lookat.SetUniform(shaderProg, "wLookAt");
-        right.SetUniform(shaderProg, "wRight");
-        up.SetUniform(shaderProg, "wUp");
+    void setAspect(float _aspect) {
+        aspect = _aspect;
+        set(eye, lookat, vup, fov);
+    }
+    vec3 getEye() const { return eye; }
+    vec3 getDirection(const vec2& cCamWindow) const { return normalize(lookat + right * cCamWindow.x + up * cCamWindow.y - eye); }
+    // Camera window rectangle vec4(lo, hi) around a sphere, its nearest depth along the view direction into depth. In
+    // camera space x / z and y / z are monotonic over the box of the sphere, so its corners bound them.
+    vec4 getWindowBounds(vec3 center, float radius, float& depth) const {
+        vec3 forward = lookat - eye, d = center - eye;
+        float f = length(forward), z = dot(d, forward) / f;
+        depth = z - radius;
+        if (depth < 1e-4f * f) return vec4(-1e30f, -1e30f, 1e30f, 1e30f);     // reaches behind the eye
+        float x = dot(d, right) / length(right), y = dot(d, up) / length(up);
+        float sx = f / length(right), sy = f / length(up);
+        vec4 bounds(1e30f, 1e30f, -1e30f, -1e30f);
+        for (int i = 0; i < 4; i++) {
+            float zc = z + ((i & 1) ? radius : -radius);
+            float xc = (x + ((i & 2) ? radius : -radius)) / zc * sx, yc = (y + ((i & 2) ? radius : -radius)) / zc * sy;
+            bounds = vec4(fminf(bounds.x, xc), fminf(bounds.y, yc), fmaxf(bounds.z, xc), fmaxf(bounds.w, yc));
+        }
+        return bounds;
+    }
+    void Pack(SceneData& d) const {
+        d.wEye = eye;
+        d.wLookAt = lookat;
+        d.wRight = right;
+        d.wUp = up;
     }
 };
 
@@ -304,22 +1170,103 @@ struct Light {
         direction = normalize(_direction);
         Le = _Le; La = _La;
     }
-    void SetUniform(unsigned int shaderProg) {
-        La.SetUniform(shaderProg, "light.La");
-        Le.SetUniform(shaderProg, "light.Le");
-        direction.SetUniform(shaderProg, "light.direction");
+    void Pack(LightData& d) const {
+        d.direction = direction;
+        d.Le = Le;
+        d.La = La;
     }
 };
 
 
+struct MirrorImage {    // a sphere seen in a cell
+    vec4 sphere;
+    vec3 weight;        // Fresnel product of the facets crossed on the way to the center
+    int cell;
+    int material;
+};
 
 class Scene {
-    int numberOfMirrors = 3;
     std::vector<Sphere *> objects;
-    std::vector<Plane *> planes;
+    Prism prism;                        // the mirrors
+    std::vector<Plane *> planes;        // any further planes
     std::vector<Light *> lights;
     Camera camera;
     std::vector<Material *> materials;
+    SceneData sceneData;                // CPU copy of the uniform block
+    UniformBlock<SceneData> sceneBlock;
+
+    RingBuffer objectRing;              // sphere texels of the frame in BVH order, written again whenever the spheres move
+    TextureBuffer objectTexture;        // reads objectRing
+    SphereBVH bvh;                      // refitted as the spheres move, rebuilt when its SAH cost has grown too much
+    bool bvhStale = true;               // new spheres, the refit is not enough
+    int nRefits = 0, nRebuilds = 0;
+    double refitUsec = 0, rebuildUsec = 0;  // total time of the refits and of the rebuilds
+    RingBuffer nodeRing;                // BVH nodes of the frame
+    TextureBuffer nodeTexture;          // reads nodeRing
+    TextureBuffer objectMaterialTexture;
+    TextureBuffer planeTexture;
+    bool useVirtualImages = false;      // the BVH holds the mirror images of the spheres instead of the spheres
+    std::vector<MirrorCell> cells;      // seen from the eye through at most maxDepth - 1 facets
+    std::vector<MirrorImage> images;
+    bool cellsDirty = true;             // new prism or depth cap
+    TextureBuffer imageInfoTexture;     // vec4(weight, cell) in BVH order
+    TextureBuffer cellTexture;
+    Uniform<int> virtualImages;
+    bool usePathCache = false;          // only the spheres are traced per frame, along the cached mirror path of each pixel;
+                                        // opt-in: ~60 MB at 1080p and a CPU rebuild per camera or resolution change
+    bool pathCacheDirty = true;         // new camera, mirrors, mirror material or depth cap
+    TextureBuffer pathIndexTexture;     // first segment and count per pixel
+    TextureBuffer pathTexture;
+    Uniform<int> pathCache, pathWidth;
+    int renderWidth = windowWidth, renderHeight = windowHeight;     // pixels traced per frame
+    bool useSlabGrid = true;            // walk a 2D grid instead of the BVH while the sphere centers share one z
+    TextureBuffer gridCellTexture;      // first and count per cell
+    TextureBuffer gridSphereTexture;
+    int maxDepth = 10;                  // cap of the segments per path, the shader can trace at most 10
+    float minWeight = 1.0f / 1024;      // below this the rest of a path adds less than a quarter of a display step
+    float rouletteWeight = 0;
+    bool showBounces = false;
+    int frame = 0;
+    bool useShadowMap = true;           // the spheres in the way of the light are looked up in a light space map first
+    TextureBuffer shadowTexture;
+    bool paused = false;
+    int nSamples = 0;                   // accumulated since the image last changed
+    bool useCheckerboard = false;       // the displacements of the spheres are written for the checkerboard frames
+    TextureBuffer motionTexture;        // vec4(displacement, 0) in BVH order
+    std::vector<vec4> previousTexels;   // of the spheres or images in the last WriteObjects
+    bool motionWritten = false;         // motionTexture is not all 0
+    Uniform<int> tracedParity;
+    bool useTileCulling = true;         // the eye rays test the spheres of their screen tile, nearest first
+    const int tileSize = 16;
+    TextureBuffer tileTexture;          // first and count per tile
+    TextureBuffer tileSphereTexture;
+    // The knobs every tracer program reads, one set per program as Uniform::Set writes the program in use. The
+    // handles a program does not read stay invalid, see CreateTracerUniforms.
+    struct TracerUniforms {
+        Uniform<int> objectBase, nodeBase, nNodes, depthCap, frameSeed, bounceView, sampleIndex, tileCulling, tileColumns;
+        Uniform<int> slabGrid, gridWidth, gridHeight, shadowMap, shadowWidth, shadowHeight;
+        Uniform<float> minWeight, rouletteWeight;
+        Uniform<vec2> jitter, gridSlab;
+        Uniform<vec4> gridBox, shadowBox;
+        Uniform<vec3> shadowU, shadowV, shadowW;
+    } fragment, compute, wavefrontIntersect, wavefrontShade, wavefrontResolve;
+    // what WriteSlabGrid, WriteShadowMap and WriteTiles found, SetTracerUniforms gives it to every program
+    struct GridShape { int on = 0, width = 1, height = 1; vec4 box; vec2 slab; } gridShape;
+    struct ShadowShape { int on = 0, width = 1, height = 1; vec4 box; vec3 u, v, w; } shadowShape;
+    struct TileShape { int on = 0, columns = 1; } tileShape;
+    int mirrorMaterial = 3;             // 3: gold, 4: silver
+    bool animated = true;               // stress test scenes stand still, the collisions are O(n^2)
+
+    // parts changed since the last upload, in steady state only the sphere positions
+    bool headerDirty = true;            // camera and object counts
+    bool lightDirty = true, materialsDirty = true, planesDirty = true, prismDirty = true;
+    bool objectsMoved = true, objectMaterialsDirty = true;
+    size_t ringBytes = 0;               // written by the last SetUniform
+
+    void checkOffset(const GPUProgram& program, const char * name, size_t offset) {
+        int blockOffset = program.getBlockOffset(name);
+        if (blockOffset >= 0 && blockOffset != (int)offset) printf("%s is at %d in SceneBlock and at %d in SceneData\n", name, blockOffset, (int)offset);
+    }
 public:
     void build() {
         vec3 eye = vec3(0, 0, 2);
@@ -327,31 +1274,18 @@ public:
         vec3 lookat = vec3(0, 0, 0);
         float fov = 45 * M_PI / 180;
         camera.set(eye, lookat, vup, fov);
+        pathCacheDirty = true;
 
         lights.push_back(new Light(vec3(0, 0, 4), vec3(1,1, 1), vec3(1,1, 1)));
 
         vec3 kd(0.3f, 0.2f, 0.1f), ks(1, 0, 0);
 
-        objects.push_back(new Sphere(vec3(0, 0, -10), 0.2 ));
-        objects.push_back(new Sphere(vec3(0, -0.5, -10), 0.2 ));
-        objects.push_back(new Sphere(vec3(0, 0.5, -10), 0.2 ));
-        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2  ));
-        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2  ));
-        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2  ));
+        buildObjects();
         //planes.push_back(new Plane(vec3(0,1,0), vec3(0,-1,-3)));
         //planes.push_back(new Plane(vec3(0,-1,0), vec3(0,1,-3)));
        // planes.push_back(new Plane(vec3(-1,0,0), vec3(1,0,-3)));
         //planes.push_back(new Plane(vec3(1,0,0), vec3(-1,0,-3)));
-        numberOfMirrors = 3;
-        float centralAngle = 2*M_PI/numberOfMirrors;
-        float currentAngle = 0;
-        for(int i = 0; i < numberOfMirrors; i++){
-            vec2 position;
-            position.x = sin(currentAngle);
-            position.y = cos(currentAngle);
-            planes.push_back(new Plane(vec3(-position.x, -position.y, 0), vec3(position.x, position.y, -3)));
-            currentAngle += centralAngle;
-        }
+        prism = Prism(3, 1, -10, 4, M_PI / 2, mirrorMaterial);     // the first mirror faces -y, the tube ends 7 units from z = -3
 
 
         materials.push_back(new RoughMaterial(vec3(1,0,0), vec3(10,10,1), 50));
@@ -360,37 +1294,680 @@ public:
         materials.push_back(new SmoothMaterial(vec3(0.17, 0.35, 1.5),vec3(3.1,2.7,1.9)));
         materials.push_back(new SmoothMaterial(vec3(0.14, 0.16, 0.13), vec3(4.1,2.3,3.1)));
     }
-    void SetUniform(unsigned int shaderProg) {
-        {
-            int location = glGetUniformLocation(shaderProg, "nObjects");
-            if (location >= 0) glUniform1i(location, objects.size()); else printf("uniform nObjects cannot be set\n");
+    void buildObjects() {   // the spheres are rough, their materials are the first three
+        objects.push_back(new Sphere(vec3(0, 0, -10), 0.2, 0));
+        objects.push_back(new Sphere(vec3(0, -0.5, -10), 0.2, 1));
+        objects.push_back(new Sphere(vec3(0, 0.5, -10), 0.2, 2));
+        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2, 0));
+        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2, 1));
+        objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, -10), 0.2, 2));
+    }
+    // n small standing spheres filling the view behind the mirrors, n = 0 brings the original spheres back
+    void buildStressTest(int n) {
+        for (int o = 0; o < objects.size(); o++) delete objects[o];
+        objects.clear();
+        if (n == 0) buildObjects();
+        float radius = 0.5f / sqrtf((float)std::max(n, 1));
+        for (int o = 0; o < n; o++) objects.push_back(new Sphere(vec3(rnd() * 2 - 1, rnd() * 2 - 1, -8 - rnd() * 4), radius, o % 3));
+        animated = (n == 0);
+        headerDirty = objectsMoved = objectMaterialsDirty = bvhStale = true;
+        if (n > 0 && useVirtualImages) setVirtualImages(false);    // millions of images
+    }
+    void Create(const GPUProgram& program) {    // after the program is linked
+        sceneData = SceneData();
+        sceneBlock.Create(0);
+        program.bindUniformBlock("SceneBlock", sceneBlock);
+        checkOffset(program, "nPlanes", offsetof(SceneData, nPlanes));
+        checkOffset(program, "light.La", offsetof(SceneData, light) + offsetof(LightData, La));
+        checkOffset(program, "materials[1].reflective", offsetof(SceneData, materials) + sizeof(MaterialData) + offsetof(MaterialData, reflective));
+        checkOffset(program, "prism.mat", offsetof(SceneData, prism) + offsetof(PrismData, material));
+        objectTexture.Create(GL_RGBA32F);
+        objectMaterialTexture.Create(GL_R32I);
+        planeTexture.Create(GL_RGBA32F);
+        program.getUniform<int>("objects").Set(0);     // texture units
+        program.getUniform<int>("objectMaterials").Set(1);
+        program.getUniform<int>("planes").Set(2);
+        program.getUniform<int>("bvhNodes").Set(3);
+        nodeTexture.Create(GL_RGBA32F);
+        program.getUniform<int>("imageInfo").Set(4);
+        program.getUniform<int>("cells").Set(5);
+        imageInfoTexture.Create(GL_RGBA32F);
+        cellTexture.Create(GL_RGBA32F);
+        virtualImages = program.getUniform<int>("virtualImages");
+        virtualImages.Set(0);
+        program.getUniform<int>("pathIndex").Set(6);
+        program.getUniform<int>("paths").Set(7);
+        pathWidth = program.getUniform<int>("pathWidth");
+        pathIndexTexture.Create(GL_RG32I);
+        pathTexture.Create(GL_RGBA32F);
+        pathCache = program.getUniform<int>("pathCache");
+        program.getUniform<int>("gridCells").Set(8);
+        program.getUniform<int>("gridSpheres").Set(9);
+        gridCellTexture.Create(GL_RG32I);
+        gridSphereTexture.Create(GL_R32I);
+        program.getUniform<int>("shadowTexels").Set(10);
+        shadowTexture.Create(GL_RGBA32F);
+        program.getUniform<int>("accumulation").Set(11);
+        program.getUniform<int>("motion").Set(12);
+        motionTexture.Create(GL_RGBA32F);
+        tracedParity = program.getUniform<int>("tracedParity");
+        tracedParity.Set(-1);
+        program.getUniform<int>("tiles").Set(15);
+        program.getUniform<int>("tileSpheres").Set(16);
+        tileTexture.Create(GL_RG32I);
+        tileSphereTexture.Create(GL_R32I);
+        program.getUniform<int>("tileSize").Set(tileSize);
+        CreateTracerUniforms(program, fragment, true);
+    }
+    template<typename T> static Uniform<T> tracerUniform(const GPUProgram& program, const char * name, bool every) {
+        return every ? program.getUniform<T>(name) : program.findUniform<T>(name);
+    }
+    // The handles of the tracer knobs in the program. every: it reads them all and a missing one is reported, as in
+    // the fragment and compute programs; a wavefront pass reads only a part.
+    void CreateTracerUniforms(const GPUProgram& program, TracerUniforms& uniforms, bool every) {
+        uniforms.objectBase = tracerUniform<int>(program, "objectBase", every);
+        uniforms.nodeBase = tracerUniform<int>(program, "nodeBase", every);
+        uniforms.nNodes = tracerUniform<int>(program, "nNodes", every);
+        uniforms.depthCap = tracerUniform<int>(program, "depthCap", every);
+        uniforms.frameSeed = tracerUniform<int>(program, "frameSeed", every);
+        uniforms.bounceView = tracerUniform<int>(program, "bounceView", every);
+        uniforms.sampleIndex = tracerUniform<int>(program, "sampleIndex", every);
+        uniforms.jitter = tracerUniform<vec2>(program, "jitter", every);
+        uniforms.minWeight = tracerUniform<float>(program, "minWeight", every);
+        uniforms.rouletteWeight = tracerUniform<float>(program, "rouletteWeight", every);
+        uniforms.tileCulling = tracerUniform<int>(program, "tileCulling", every);
+        uniforms.tileColumns = tracerUniform<int>(program, "tileColumns", every);
+        uniforms.slabGrid = tracerUniform<int>(program, "slabGrid", every);
+        uniforms.gridWidth = tracerUniform<int>(program, "gridWidth", every);
+        uniforms.gridHeight = tracerUniform<int>(program, "gridHeight", every);
+        uniforms.gridBox = tracerUniform<vec4>(program, "gridBox", every);
+        uniforms.gridSlab = tracerUniform<vec2>(program, "gridSlab", every);
+        uniforms.shadowMap = tracerUniform<int>(program, "shadowMap", every);
+        uniforms.shadowWidth = tracerUniform<int>(program, "shadowWidth", every);
+        uniforms.shadowHeight = tracerUniform<int>(program, "shadowHeight", every);
+        uniforms.shadowBox = tracerUniform<vec4>(program, "shadowBox", every);
+        uniforms.shadowU = tracerUniform<vec3>(program, "shadowU", every);
+        uniforms.shadowV = tracerUniform<vec3>(program, "shadowV", every);
+        uniforms.shadowW = tracerUniform<vec3>(program, "shadowW", every);
+    }
+    void CreateTrace(const GPUProgram& program, TracerUniforms& uniforms) {     // the part the wavefront passes that intersect share
+        program.bindUniformBlock("SceneBlock", sceneBlock);
+        program.getUniform<int>("objects").Set(0);
+        program.getUniform<int>("planes").Set(2);
+        program.getUniform<int>("bvhNodes").Set(3);
+        program.getUniform<int>("gridCells").Set(8);
+        program.getUniform<int>("gridSpheres").Set(9);
+        CreateTracerUniforms(program, uniforms, false);
+    }
+    // the intersect and shade programs built from fragmentSource, and the resolve program, after their linking
+    void CreateWavefront(GPUProgram& intersectProgram, GPUProgram& shadeProgram, GPUProgram& resolveProgram) {
+        intersectProgram.Use();
+        CreateTrace(intersectProgram, wavefrontIntersect);
+        intersectProgram.getUniform<int>("objectMaterials").Set(1);
+        intersectProgram.getUniform<int>("tiles").Set(15);
+        intersectProgram.getUniform<int>("tileSpheres").Set(16);
+        intersectProgram.getUniform<int>("tileSize").Set(tileSize);
+        shadeProgram.Use();
+        CreateTrace(shadeProgram, wavefrontShade);
+        shadeProgram.getUniform<int>("shadowTexels").Set(10);
+        shadeProgram.getUniform<int>("accumulation").Set(11);
+        resolveProgram.Use();
+        resolveProgram.getUniform<int>("accumulation").Set(11);
+        CreateTracerUniforms(resolveProgram, wavefrontResolve, false);
+    }
+    void CreateCompute(const GPUProgram& program) {     // the compute backend, after Create and its own linking
+        program.bindUniformBlock("SceneBlock", sceneBlock);
+        program.getUniform<int>("accumulation").Set(11);
+        CreateTracerUniforms(program, compute, true);
+    }
+    vec2 getJitter() const { return nSamples == 0 ? vec2(0, 0) : vec2(halton(nSamples, 2) - 0.5f, halton(nSamples, 3) - 0.5f); }
+    // After SetUniform with the compute program in use: its uniforms, and the stores of the ring and texture buffers as
+    // its storage blocks 0 to 5 and 7 to 9, 6 is the ray queue
+    void SetComputeUniform() {
+        SetTracerUniforms(compute);
+        objectRing.BindStorage(0);
+        nodeRing.BindStorage(1);
+        objectMaterialTexture.BindStorage(2);
+        planeTexture.BindStorage(3);
+        tileTexture.BindStorage(4);
+        tileSphereTexture.BindStorage(5);
+        gridCellTexture.BindStorage(7);
+        gridSphereTexture.BindStorage(8);
+        shadowTexture.BindStorage(9);
+    }
+    void SetTracerUniforms(const TracerUniforms& uniforms) {     // with their program in use
+        uniforms.objectBase.Set((int)(objectRing.getOffset() / sizeof(vec4)));
+        uniforms.nodeBase.Set((int)(nodeRing.getOffset() / sizeof(vec4)));
+        uniforms.nNodes.Set((int)bvh.getNodes().size());
+        uniforms.depthCap.Set(maxDepth);
+        uniforms.frameSeed.Set(frame);
+        uniforms.bounceView.Set(showBounces ? 1 : 0);
+        uniforms.sampleIndex.Set(nSamples);
+        uniforms.jitter.Set(getJitter());
+        uniforms.minWeight.Set(minWeight);
+        uniforms.rouletteWeight.Set(rouletteWeight);
+        uniforms.tileCulling.Set(tileShape.on);
+        uniforms.tileColumns.Set(tileShape.columns);
+        uniforms.slabGrid.Set(gridShape.on);
+        uniforms.gridWidth.Set(gridShape.width);
+        uniforms.gridHeight.Set(gridShape.height);
+        uniforms.gridBox.Set(gridShape.box);
+        uniforms.gridSlab.Set(gridShape.slab);
+        uniforms.shadowMap.Set(shadowShape.on);
+        uniforms.shadowWidth.Set(shadowShape.width);
+        uniforms.shadowHeight.Set(shadowShape.height);
+        uniforms.shadowBox.Set(shadowShape.box);
+        uniforms.shadowU.Set(shadowShape.u);
+        uniforms.shadowV.Set(shadowShape.v);
+        uniforms.shadowW.Set(shadowShape.w);
+    }
+    // After SetUniform: the uniforms of the wavefront programs, each made the program in use in turn
+    void SetWavefrontUniform(GPUProgram& intersectProgram, GPUProgram& shadeProgram, GPUProgram& resolveProgram) {
+        intersectProgram.Use();
+        SetTracerUniforms(wavefrontIntersect);
+        shadeProgram.Use();
+        SetTracerUniforms(wavefrontShade);
+        resolveProgram.Use();
+        SetTracerUniforms(wavefrontResolve);
+    }
+    void SetUniform() {     // uploads the dirty parts of the static block, one glBufferSubData each, and writes the spheres
+        if (headerDirty || lightDirty || materialsDirty || planesDirty || prismDirty || objectsMoved || objectMaterialsDirty) nSamples = 0;
+        sceneBlock.ResetStats();
+        objectMaterialTexture.ResetStats();
+        planeTexture.ResetStats();
+        imageInfoTexture.ResetStats();
+        cellTexture.ResetStats();
+        pathIndexTexture.ResetStats();
+        pathTexture.ResetStats();
+        gridCellTexture.ResetStats();
+        gridSphereTexture.ResetStats();
+        shadowTexture.ResetStats();
+        motionTexture.ResetStats();
+        tileTexture.ResetStats();
+        tileSphereTexture.ResetStats();
+        if (headerDirty) {
+            sceneData.nObjects = objects.size();
+            sceneData.nPlanes = planes.size();
+            camera.Pack(sceneData);
+            sceneBlock.UploadRange(sceneData, 0, offsetof(SceneData, light));
+            headerDirty = false;
+        }
+        if (lightDirty) {
+            lights[0]->Pack(sceneData.light);
+            sceneBlock.UploadRange(sceneData, offsetof(SceneData, light), sizeof(LightData));
+            lightDirty = false;
+        }
+        if (materialsDirty) {
+            for (int mat = 0; mat < materials.size() && mat < 5; mat++) materials[mat]->Pack(sceneData.materials[mat]);
+            sceneBlock.UploadRange(sceneData, offsetof(SceneData, materials), sizeof(sceneData.materials));
+            materialsDirty = false;
+        }
+        if (prismDirty) {
+            prism.Pack(sceneData.prism);
+            sceneBlock.UploadRange(sceneData, offsetof(SceneData, prism), sizeof(PrismData));
+            prismDirty = false;
+        }
+        bool cached = usePathCache && planes.empty();  // the cache only follows the prism
+        if (cached && pathCacheDirty) buildPathCache();
+        pathCache.Set(cached ? 1 : 0);
+        ringBytes = 0;
+        if (objectsMoved) WriteObjects();       // may reorder the spheres, so before their materials
+        else if (motionWritten) {               // standing still
+            motionTexture.Upload(std::vector<vec4>(bvh.getOrder().size(), vec4(0, 0, 0, 0)));
+            motionWritten = false;
+        }
+        if (planesDirty) {
+            std::vector<vec4> texels(2 * planes.size());
+            for (int o = 0; o < planes.size(); o++) planes[o]->Pack(texels[2 * o], texels[2 * o + 1]);
+            planeTexture.Upload(texels);
+            planesDirty = false;
         }
-        {
-            int location = glGetUniformLocation(shaderProg, "nPlanes");
-            if (location >= 0) glUniform1i(location, planes.size()); else printf("uniform nObjects cannot be set\n");
+        if (objectMaterialsDirty) {
+            const std::vector<int>& order = bvh.getOrder();
+            std::vector<int> objectMaterials(order.size());
+            for (int o = 0; o < order.size(); o++) objectMaterials[o] = useVirtualImages ? images[order[o]].material : objects[order[o]]->material;
+            objectMaterialTexture.Upload(objectMaterials);
+            objectMaterialsDirty = false;
         }
-        for (int o = 0; o < objects.size(); o++) objects[o]->SetUniform(shaderProg, o);
-        for (int o = 0; o < planes.size(); o++) planes[o]->SetUniform(shaderProg, o);
-        lights[0]->SetUniform(shaderProg);
-        camera.SetUniform(shaderProg);
-        for (int mat = 0; mat < materials.size(); mat++) materials[mat]->SetUniform(shaderProg, mat);
+        objectTexture.Bind(0);
+        objectMaterialTexture.Bind(1);
+        planeTexture.Bind(2);
+        nodeTexture.Bind(3);
+        imageInfoTexture.Bind(4);
+        cellTexture.Bind(5);
+        pathIndexTexture.Bind(6);
+        pathTexture.Bind(7);
+        gridCellTexture.Bind(8);
+        gridSphereTexture.Bind(9);
+        shadowTexture.Bind(10);
+        motionTexture.Bind(12);
+        tileTexture.Bind(15);
+        tileSphereTexture.Bind(16);
+        SetTracerUniforms(fragment);
     }
-    void increaseMirrorNumber(){
-        for(int i = 0; i < numberOfMirrors; i++){
-            planes.pop_back();
+    int getUploadCount() const {        // of the last SetUniform
+        return sceneBlock.getUploadCount() + objectMaterialTexture.getUploadCount() + planeTexture.getUploadCount() +
+               imageInfoTexture.getUploadCount() + cellTexture.getUploadCount() + pathIndexTexture.getUploadCount() + pathTexture.getUploadCount() +
+               gridCellTexture.getUploadCount() + gridSphereTexture.getUploadCount() + shadowTexture.getUploadCount() +
+               motionTexture.getUploadCount() + tileTexture.getUploadCount() + tileSphereTexture.getUploadCount();
+    }
+    size_t getUploadedBytes() const {
+        return sceneBlock.getUploadedBytes() + objectMaterialTexture.getUploadedBytes() + planeTexture.getUploadedBytes() +
+               imageInfoTexture.getUploadedBytes() + cellTexture.getUploadedBytes() + pathIndexTexture.getUploadedBytes() + pathTexture.getUploadedBytes() +
+               gridCellTexture.getUploadedBytes() + gridSphereTexture.getUploadedBytes() + shadowTexture.getUploadedBytes() +
+               motionTexture.getUploadedBytes() + tileTexture.getUploadedBytes() + tileSphereTexture.getUploadedBytes();
+    }
+    size_t getRingBytes() const { return ringBytes; }
+    int getStallCount() const { return objectRing.getStallCount() + nodeRing.getStallCount(); }
+    int getRefitCount() const { return nRefits; }
+    int getRebuildCount() const { return nRebuilds; }
+    double getRefitUsec() const { return nRefits > 0 ? refitUsec / nRefits : 0; }        // average
+    double getRebuildUsec() const { return nRebuilds > 0 ? rebuildUsec / nRebuilds : 0; }
+    // the spheres of this frame and their BVH into the next free ring regions, no wait while the GPU draws the previous ones
+    // the texture reads every region of the ring, so fewer regions are used when three are more texels than
+    // GL_MAX_TEXTURE_BUFFER_SIZE; a single region too large leaves the spheres past the limit unreadable
+    void CreateTexelRing(RingBuffer& ring, TextureBuffer& texture, size_t bytes) {
+        for (int nRegions = 3; ; nRegions--) {
+            ring.Create(0, bytes, nRegions, GL_TEXTURE_BUFFER);
+            size_t texels = ring.getRegionCount() * ring.getRegionSize() / sizeof(vec4);
+            if (texels <= (size_t)texture.getMaxTexels()) break;
+            if (ring.getRegionCount() == 1) {
+                printf("ring of %d texels, only %d can be read\n", (int)texels, texture.getMaxTexels());
+                break;
+            }
+        }
+        texture.Attach(ring.getBufferId());
+    }
+
+    void WriteObjects() {
+        objectsMoved = false;
+        std::vector<vec4> sphereTexels(objects.size());
+        for (int o = 0; o < objects.size(); o++) sphereTexels[o] = objects[o]->texel();
+        if (useVirtualImages) buildImages(sphereTexels);
+        auto tStart = std::chrono::high_resolution_clock::now();
+        bool rebuilt = true;
+        if (bvhStale) bvh.Build(sphereTexels);
+        else rebuilt = bvh.Update(sphereTexels);
+        double usec = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - tStart).count();
+        if (rebuilt) {          // the spheres are in a new order
+            nRebuilds++;
+            rebuildUsec += usec;
+            objectMaterialsDirty = true;
+        } else {
+            nRefits++;
+            refitUsec += usec;
+        }
+        bvhStale = false;
+        if (sphereTexels.empty()) {
+            gridShape.on = shadowShape.on = tileShape.on = 0;
+            return;
+        }
+
+        const std::vector<int>& order = bvh.getOrder();
+        if (useVirtualImages) {
+            std::vector<vec4> info(order.size());
+            for (int o = 0; o < order.size(); o++) {
+                const MirrorImage& image = images[order[o]];
+                info[o] = vec4(image.weight.x, image.weight.y, image.weight.z, (float)image.cell);
+            }
+            imageInfoTexture.Upload(info);
+        }
+        size_t bytes = sphereTexels.size() * sizeof(vec4);
+        if (bytes > objectRing.getRegionSize()) {
+            CreateTexelRing(objectRing, objectTexture, bytes);
         }
-        numberOfMirrors++;
-        float centralAngle = 2*M_PI/numberOfMirrors;
-        float currentAngle = 0;
-        for(int i = 0; i < numberOfMirrors; i++){
-            vec2 position;
-            position.x = sin(currentAngle);
-            position.y = cos(currentAngle);
-            planes.push_back(new Plane(vec3(-position.x, -position.y, 0), vec3(position.x, position.y, -3)));
-            currentAngle += centralAngle;
+        vec4 * texels = (vec4 *)objectRing.Map();
+        if (texels) {
+            for (int o = 0; o < order.size(); o++) texels[o] = sphereTexels[order[o]];
+            objectRing.Unmap();
         }
+
+        size_t nodeBytes = 2 * bvh.getNodes().size() * sizeof(vec4);
+        if (nodeBytes > nodeRing.getRegionSize()) {
+            CreateTexelRing(nodeRing, nodeTexture, nodeBytes);
+        }
+        vec4 * nodeTexels = (vec4 *)nodeRing.Map();
+        if (nodeTexels) {
+            bvh.Pack(nodeTexels);
+            nodeRing.Unmap();
+        }
+        ringBytes = bytes + nodeBytes;
+        WriteSlabGrid(sphereTexels, order);
+        WriteShadowMap(sphereTexels, order);
+        WriteMotion(sphereTexels, order);
+        WriteTiles(sphereTexels, order);
+    }
+    // The sphere slots binned by the tiles of the render target their window rectangles overlap, widened by a pixel for
+    // the jitter of the samples. The slots go in by their nearest depth, so the list of every tile is sorted.
+    void WriteTiles(const std::vector<vec4>& sphereTexels, const std::vector<int>& order) {
+        tileShape.on = useTileCulling ? 1 : 0;
+        if (!useTileCulling) return;
+        int columns = (renderWidth + tileSize - 1) / tileSize, rows = (renderHeight + tileSize - 1) / tileSize;
+        int n = (int)order.size();
+        std::vector<float> depth(n);
+        std::vector<int> tileRange(4 * n);
+        std::vector<int> tiles(2 * columns * rows, 0);
+        int total = 0;
+        for (int slot = 0; slot < n; slot++) {
+            const vec4& s = sphereTexels[order[slot]];
+            vec4 b = camera.getWindowBounds(vec3(s.x, s.y, s.z), s.w, depth[slot]);
+            float x0 = (b.x + 1) / 2 * renderWidth - 1, y0 = (b.y + 1) / 2 * renderHeight - 1;
+            float x1 = (b.z + 1) / 2 * renderWidth + 1, y1 = (b.w + 1) / 2 * renderHeight + 1;
+            int * r = &tileRange[4 * slot];
+            r[0] = (int)floorf(fminf(fmaxf(x0, 0), (float)renderWidth) / tileSize);
+            r[1] = (int)floorf(fminf(fmaxf(y0, 0), (float)renderHeight) / tileSize);
+            r[2] = (int)floorf(fminf(fmaxf(x1, -1), (float)(renderWidth - 1)) / tileSize);
+            r[3] = (int)floorf(fminf(fmaxf(y1, -1), (float)(renderHeight - 1)) / tileSize);
+            for (int y = r[1]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[2]; x++) tiles[2 * (x + y * columns) + 1]++;
+        }
+        for (int t = 0; t < columns * rows; t++) {
+            tiles[2 * t] = total;
+            total += tiles[2 * t + 1];
+            tiles[2 * t + 1] = 0;
+        }
+        std::vector<int> byDepth(n);
+        for (int slot = 0; slot < n; slot++) byDepth[slot] = slot;
+        std::sort(byDepth.begin(), byDepth.end(), [&depth](int a, int b) { return depth[a] < depth[b]; });
+        std::vector<int> slots(std::max(total, 1));
+        for (int slot : byDepth) {
+            const int * r = &tileRange[4 * slot];
+            for (int y = r[1]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[2]; x++) {
+                    int t = x + y * columns;
+                    slots[tiles[2 * t] + tiles[2 * t + 1]++] = slot;
+                }
+        }
+        tileTexture.Upload(&tiles[0], tiles.size() * sizeof(int), 2 * sizeof(int));
+        tileSphereTexture.Upload(slots);
+        tileShape.columns = columns;
+    }
+    // The displacement of each sphere since the last frame in slot order, 0 if the set of spheres or images changed
+    void WriteMotion(const std::vector<vec4>& sphereTexels, const std::vector<int>& order) {
+        if (!useCheckerboard) {
+            previousTexels.clear();
+            return;
+        }
+        std::vector<vec4> texels(order.size(), vec4(0, 0, 0, 0));
+        if (previousTexels.size() == sphereTexels.size()) {
+            for (int slot = 0; slot < order.size(); slot++) {
+                const vec4 &s = sphereTexels[order[slot]], &p = previousTexels[order[slot]];
+                texels[slot] = vec4(s.x - p.x, s.y - p.y, s.z - p.z, 0);
+            }
+        }
+        motionTexture.Upload(texels);
+        motionWritten = true;
+        previousTexels = sphereTexels;
+    }
+    // The spheres seen from the directional light, in slot order. Each texel keeps the two highest sphere tops along the
+    // light over it and the highest bottom of the spheres covering all of it, widened by eps against the float rounding
+    // of the shader, so the lookup only sends the points near the silhouettes to a shadow ray.
+    void WriteShadowMap(const std::vector<vec4>& sphereTexels, const std::vector<int>& order) {
+        bool on = useShadowMap && !useVirtualImages;   // the images are shadowed cell by cell
+        shadowShape.on = on ? 1 : 0;
+        if (!on) return;
+
+        vec3 w = normalize(lights[0]->direction);
+        vec3 u = normalize(cross(fabsf(w.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0), w)), v = cross(w, u);
+        int n = (int)order.size();
+        vec2 lo(1e30f, 1e30f), hi(-1e30f, -1e30f);
+        for (int o = 0; o < n; o++) {
+            const vec4& s = sphereTexels[o];
+            vec3 c(s.x, s.y, s.z);
+            lo = vec2(fminf(lo.x, dot(c, u) - s.w), fminf(lo.y, dot(c, v) - s.w));
+            hi = vec2(fmaxf(hi.x, dot(c, u) + s.w), fmaxf(hi.y, dot(c, v) + s.w));
+        }
+        float extent = fmaxf(fmaxf(hi.x - lo.x, hi.y - lo.y), 1e-6f), eps = 1e-4f * extent;
+        int res = std::max(128, std::min(1024, (int)ceilf(sqrtf(16.0f * n))));      // texels along the longer side
+        float size = extent / res;
+        int width = std::max(1, (int)ceilf((hi.x - lo.x) / size)), height = std::max(1, (int)ceilf((hi.y - lo.y) / size));
+
+        std::vector<vec4> texels(width * height, vec4(-1e30f, -1, -1e30f, -1e30f));
+        for (int slot = 0; slot < n; slot++) {
+            const vec4& s = sphereTexels[order[slot]];
+            vec3 c(s.x, s.y, s.z);
+            vec2 cuv(dot(c, u) - lo.x, dot(c, v) - lo.y);
+            float r = s.w + eps, top = dot(c, w) + s.w + eps, bottom = dot(c, w) - s.w - eps;
+            int x0 = std::max(0, (int)((cuv.x - r) / size)), x1 = std::min(width - 1, (int)((cuv.x + r) / size));
+            int y0 = std::max(0, (int)((cuv.y - r) / size)), y1 = std::min(height - 1, (int)((cuv.y + r) / size));
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    float ax = x * size - eps, bx = (x + 1) * size + eps, ay = y * size - eps, by = (y + 1) * size + eps;
+                    float nx = fmaxf(fmaxf(ax - cuv.x, cuv.x - bx), 0), ny = fmaxf(fmaxf(ay - cuv.y, cuv.y - by), 0);
+                    if (nx * nx + ny * ny > r * r) continue;      // does not touch the texel
+                    vec4& t = texels[x + y * width];
+                    if (top > t.x) {
+                        t.z = t.x;
+                        t.x = top;
+                        t.y = (float)slot;
+                    } else if (top > t.z) t.z = top;
+                    float fx = fmaxf(cuv.x - ax, bx - cuv.x), fy = fmaxf(cuv.y - ay, by - cuv.y);
+                    if (fx * fx + fy * fy <= s.w * s.w) t.w = fmaxf(t.w, bottom);   // covers all of the texel
+                }
+            }
+        }
+        shadowTexture.Upload(texels);
+        shadowShape.width = width;
+        shadowShape.height = height;
+        shadowShape.box = vec4(lo.x, lo.y, size, size);
+        shadowShape.u = u;
+        shadowShape.v = v;
+        shadowShape.w = w;
+    }
+    // A ray crosses the slab of spheres sharing one z in a few cells of a 2D grid over it, fewer texel fetches than the
+    // BVH walk. Rebuilt every frame in BVH slot order, switched off as soon as a center leaves the plane.
+    void WriteSlabGrid(const std::vector<vec4>& sphereTexels, const std::vector<int>& order) {
+        bool planar = useSlabGrid;
+        for (int o = 1; o < sphereTexels.size() && planar; o++) planar = fabsf(sphereTexels[o].z - sphereTexels[0].z) <= 1e-4f;
+        gridShape.on = planar ? 1 : 0;
+        if (!planar) return;
+
+        int n = (int)order.size();
+        vec2 lo(1e30f, 1e30f), hi(-1e30f, -1e30f);
+        float zLo = 1e30f, zHi = -1e30f;
+        for (int o = 0; o < n; o++) {
+            const vec4& s = sphereTexels[o];
+            lo = vec2(fminf(lo.x, s.x - s.w), fminf(lo.y, s.y - s.w));
+            hi = vec2(fmaxf(hi.x, s.x + s.w), fmaxf(hi.y, s.y + s.w));
+            zLo = fminf(zLo, s.z - s.w);
+            zHi = fmaxf(zHi, s.z + s.w);
+        }
+        float eps = 1e-5f * fmaxf(fmaxf(hi.x - lo.x, hi.y - lo.y), 1.0f);     // the float rounding of the hit points
+        lo = lo - vec2(eps, eps);
+        hi = hi + vec2(eps, eps);
+        // about two cells per sphere, square ones
+        float cellSize = sqrtf((hi.x - lo.x) * (hi.y - lo.y) / (2 * n));
+        int width = std::max(1, std::min(1024, (int)ceilf((hi.x - lo.x) / cellSize)));
+        int height = std::max(1, std::min(1024, (int)ceilf((hi.y - lo.y) / cellSize)));
+        vec2 size((hi.x - lo.x) / width, (hi.y - lo.y) / height);
+
+        // counting sort of the sphere slots by the cells their squares overlap
+        std::vector<int> cells(2 * width * height, 0);
+        std::vector<int> cellRange(4 * n);
+        int total = 0;
+        for (int slot = 0; slot < n; slot++) {
+            const vec4& s = sphereTexels[order[slot]];
+            int * r = &cellRange[4 * slot];
+            r[0] = std::max(0, (int)((s.x - s.w - lo.x) / size.x));
+            r[1] = std::max(0, (int)((s.y - s.w - lo.y) / size.y));
+            r[2] = std::min(width - 1, (int)((s.x + s.w - lo.x) / size.x));
+            r[3] = std::min(height - 1, (int)((s.y + s.w - lo.y) / size.y));
+            for (int y = r[1]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[2]; x++) cells[2 * (x + y * width) + 1]++;
+        }
+        for (int c = 0; c < width * height; c++) {
+            cells[2 * c] = total;
+            total += cells[2 * c + 1];
+            cells[2 * c + 1] = 0;
+        }
+        std::vector<int> slots(std::max(total, 1));
+        for (int slot = 0; slot < n; slot++) {
+            const int * r = &cellRange[4 * slot];
+            for (int y = r[1]; y <= r[3]; y++)
+                for (int x = r[0]; x <= r[2]; x++) {
+                    int c = x + y * width;
+                    slots[cells[2 * c] + cells[2 * c + 1]++] = slot;
+                }
+        }
+        gridCellTexture.Upload(&cells[0], cells.size() * sizeof(int), 2 * sizeof(int));
+        gridSphereTexture.Upload(slots);
+        gridShape.width = width;
+        gridShape.height = height;
+        gridShape.box = vec4(lo.x, lo.y, size.x, size.y);
+        gridShape.slab = vec2(zLo - eps, zHi + eps);
+    }
+    // replaces the sphere texels by those of every sphere in every cell
+    void buildImages(std::vector<vec4>& sphereTexels) {
+        vec3 eye = camera.getEye();
+        if (cellsDirty) {
+            prism.buildCells(vec2(eye.x, eye.y), maxDepth - 1, cells);
+            std::vector<vec4> texels(2 * cells.size());
+            for (int c = 0; c < cells.size(); c++) {
+                texels[2 * c] = vec4(cells[c].u0.x, cells[c].u0.y, cells[c].u1.x, cells[c].u1.y);
+                texels[2 * c + 1] = vec4(cells[c].portalNormal.x, cells[c].portalNormal.y, cells[c].portalOffset, 0);
+            }
+            cellTexture.Upload(texels);
+            cellsDirty = false;
+        }
+        images.resize(cells.size() * objects.size());
+        for (int c = 0; c < cells.size(); c++) {
+            const MirrorCell& cell = cells[c];
+            for (int o = 0; o < objects.size(); o++) {
+                MirrorImage& image = images[c * objects.size() + o];
+                vec2 center = cell.map(vec2(objects[o]->center.x, objects[o]->center.y));
+                image.sphere = vec4(center.x, center.y, objects[o]->center.z, objects[o]->radius);
+                image.cell = c;
+                image.material = objects[o]->material;
+                image.weight = vec3(1, 1, 1);
+                vec3 dir = normalize(vec3(center.x, center.y, objects[o]->center.z) - eye);
+                for (int f = 0; f < cell.normals.size(); f++) image.weight = image.weight * materials[prism.material]->Fresnel(fabsf(dot(dir, cell.normals[f])));
+            }
+        }
+        sphereTexels.resize(images.size());
+        for (int i = 0; i < images.size(); i++) sphereTexels[i] = images[i].sphere;
+    }
+    // The path of each pixel's ray through the mirrors without the spheres, as the shader would bounce it: start, t of
+    // the next mirror and the Fresnel weight so far per segment. It only changes with the camera and the mirrors.
+    void buildPathCache() {
+        const float epsilon = 0.0001f;
+        long tStart = glutGet(GLUT_ELAPSED_TIME);
+        std::vector<int> index(2 * renderWidth * renderHeight);
+        std::vector<vec4> segments;
+        segments.reserve(3 * 4 * renderWidth * renderHeight);
+        const Material * mirror = materials[prism.material];
+        vec3 eye = camera.getEye();
+        for (int y = 0; y < renderHeight; y++) {
+            for (int x = 0; x < renderWidth; x++) {
+                vec3 start = eye, dir = camera.getDirection(vec2((x + 0.5f) * 2 / renderWidth - 1, (y + 0.5f) * 2 / renderHeight - 1));
+                vec3 weight(1, 1, 1);
+                int pixel = y * renderWidth + x;
+                index[2 * pixel] = (int)segments.size() / 3;
+                for (int d = 0; d < maxDepth; d++) {
+                    vec3 normal;
+                    float t = prism.intersect(start, dir, normal);
+                    segments.push_back(vec4(start.x, start.y, start.z, t > 0 ? t : 1e30f));
+                    segments.push_back(vec4(dir.x, dir.y, dir.z, 0));
+                    segments.push_back(vec4(weight.x, weight.y, weight.z, 0));
+                    if (t <= 0) break;
+                    if (dot(dir, normal) > 0) normal = normal * (-1);
+                    weight = weight * mirror->Fresnel(dot(dir * (-1), normal));
+                    start = start + dir * t + normal * epsilon;
+                    dir = dir - normal * 2 * dot(normal, dir);
+                }
+                index[2 * pixel + 1] = (int)segments.size() / 3 - index[2 * pixel];
+            }
+        }
+        pathIndexTexture.Upload(&index[0], index.size() * sizeof(int), 2 * sizeof(int));
+        pathTexture.Upload(segments);
+        pathWidth.Set(renderWidth);
+        printf("\npath cache: %d segments, %d KB in %d msec\n", (int)segments.size() / 3,
+               (int)((index.size() * sizeof(int) + segments.size() * sizeof(vec4)) / 1024), (int)(glutGet(GLUT_ELAPSED_TIME) - tStart));
+        pathCacheDirty = false;
+    }
+    void setSlabGrid(bool on) {
+        useSlabGrid = on;
+        objectsMoved = true;
+    }
+    bool getSlabGrid() const { return useSlabGrid; }
+    void setTileCulling(bool on) {
+        useTileCulling = on;
+        objectsMoved = true;
+    }
+    bool getTileCulling() const { return useTileCulling; }
+    void setPathCache(bool on) {
+        usePathCache = on;
+        nSamples = 0;
+    }
+    bool getPathCache() const { return usePathCache; }
+    void setVirtualImages(bool on) {
+        useVirtualImages = on;
+        virtualImages.Set(on ? 1 : 0);
+        objectsMoved = objectMaterialsDirty = bvhStale = cellsDirty = true;
+    }
+    bool getVirtualImages() const { return useVirtualImages; }
+    void setMirrorMaterial(int material) {
+        mirrorMaterial = material;
+        prism.material = material;
+        for (int o = 0; o < planes.size(); o++) planes[o]->material = material;
+        planesDirty = prismDirty = pathCacheDirty = true;
+    }
+    void EndFrame() {       // after the draw calls of the frame
+        objectRing.Fence();
+        nodeRing.Fence();
+        if (rouletteWeight > 0) frame++;     // new noise every frame
+        nSamples++;
+    }
+    void setResolution(int width, int height) {     // of the render target, the path cache is per pixel
+        renderWidth = width;
+        renderHeight = height;
+        pathCacheDirty = objectsMoved = true;     // the tiles too
+        nSamples = 0;
+    }
+    void setAspect(float aspect) {      // of the window
+        camera.setAspect(aspect);
+        headerDirty = pathCacheDirty = objectsMoved = true;
+    }
+    int getSampleCount() const { return nSamples; }    // in the accumulation target, the image changed if 0
+    void restartAccumulation() { nSamples = 0; }      // another tracer draws the same image
+    void setPaused(bool on) { paused = on; }
+    void setCheckerboard(bool on) { useCheckerboard = on; }
+    bool getCheckerboard() const { return useCheckerboard; }
+    void setTracedParity(int parity) { tracedParity.Set(parity); }     // -1: every pixel
+    bool getPaused() const { return paused; }
+    void setMaxDepth(int depth) {
+        maxDepth = std::max(1, std::min(10, depth));
+        cellsDirty = pathCacheDirty = true;
+        nSamples = 0;
+        printf("\nmax depth %d\n", maxDepth);
+    }
+    int getMaxDepth() const { return maxDepth; }
+    void setMinWeight(float weight) {
+        minWeight = weight;
+        nSamples = 0;
+    }
+    void setRouletteWeight(float weight) {    // 0: off
+        rouletteWeight = weight;
+        nSamples = 0;
+    }
+    float getRouletteWeight() const { return rouletteWeight; }
+    void setBounceView(bool on) {
+        showBounces = on;
+        nSamples = 0;
+    }
+    bool getBounceView() const { return showBounces; }
+    void setShadowMap(bool on) {
+        useShadowMap = on;
+        objectsMoved = true;
+    }
+    bool getShadowMap() const { return useShadowMap; }
+    void increaseMirrorNumber(){    // costs nothing per ray
+        prism.nSides++;
+        prismDirty = cellsDirty = pathCacheDirty = true;
+        if (useVirtualImages) objectsMoved = true;
     }
     void Animate(float dt) {
+        if (!animated || paused) return;
+        objectsMoved = true;
         for(int i = 0; i< objects.size(); i++){
             objects[i]->animate(dt);
             for(int j = 0; j< objects.size(); j++) {
@@ -407,12 +1984,24 @@ public:
                     force = force-planes[j]->normal*2*dot(force,planes[j]->normal);
                 }
             }
+            int first, last;
+            prism.getFacets(*objects[i], first, last);
+            for(int k = first; k <= last; k++) {
+                if(prism.collide(*objects[i], k))
+                {
+                    vec3 n = prism.getNormal(k);
+                    vec3& force = objects[i]->force;
+                    force = force-n*2*dot(force,n);
+                }
+            }
 
         }
     }
 };
 
 GPUProgram gpuProgram; // vertex and fragment shaders
+std::string fragmentVariant(const char * defines) { return std::string("#version 330\n") + defines + traceSource + fragmentSource; }
+std::string computeVariant() { return std::string("#define COMPUTE\n") + traceSource + computeSource; }
 Scene scene;
 
 class FullScreenTexturedQuad {
@@ -440,18 +2029,252 @@ public:
 };
 
 FullScreenTexturedQuad fullScreenTexturedQuad;
+// While the image does not change, each frame adds one jittered sample to the mean in the other target, up to maxSamples
+RenderTarget accumulationTargets[2];
+const int maxSamples = 64;
+// While the image changes, a checkerboard frame traces every other pixel into tracedTarget with its motion, alternating
+// between the frames, and reconstructProgram fills the rest from the previous frame into the accumulation target
+GPUProgram reconstructProgram;
+Uniform<int> reconstructParity;
+RenderTarget tracedTarget;              // color and motion, half as wide
+bool previousFrameValid = false;        // the other accumulation target holds the last frame in this size
+// The wavefront tracer writes the eye rays into rayStates[0], then per bounce intersects into hitTarget and shades into
+// the other ray state buffer, and killProgram takes the ended rays out of the stencil mask that these targets share.
+// Scene sets the uniforms of its programs, the ray state is read through the units 17 to 24.
+bool wavefront = false;
+GPUProgram intersectProgram, shadeProgram;     // fragmentSource with WAVEFRONT 1 and 2
+GPUProgram killProgram, resolveProgram;
+Uniform<int> intersectBounce, shadeBounce, eyePass;
+RenderTarget rayStates[2];              // start and record, dir, weight, radiance
+RenderTarget hitTarget;                 // normal and t, material and slot
+const int maxBounces = 10;
+unsigned int bounceQueries[2][maxBounces];  // of this frame and the last one, read a frame late so they do not stall
+int queriedDepth[2] = { 0, 0 };         // bounces timed by each set of queries, 0: nothing to read
+int wavefrontFrame = 0;                 // its parity is the set of this frame
+double bounceMsec[maxBounces];          // GPU time of each bounce summed over the frames since the last report
+int bounceFrames[maxBounces];           // frames that reached the bounce since the last report, the depth may change
+int nWavefrontFrames = 0;               // read since the last report
+
+void createWavefrontTargets(int width, int height) {
+    rayStates[0].Create(width, height, 4);
+    rayStates[0].CreateStencil();
+    rayStates[1].Create(width, height, 4);
+    rayStates[1].CreateStencil(&rayStates[0]);
+    hitTarget.Create(width, height, 2);
+    hitTarget.CreateStencil(&rayStates[0]);
+}
+
+// The compute backend traces into the accumulation target instead, see hasComputeShaders
+bool computeAvailable = false, computeTracer = false;
+GPUProgram computeProgram;
+Uniform<int> computePass;
+StorageBuffer rayQueue;                 // two counters, then the rays after their first mirror
+const int persistentGroups = 64;        // of 256 threads, enough to fill a GPU, they take queued rays until none is left
+
+void createComputeTargets(int width, int height) {     // room for every pixel in the queue, it grows but never shrinks
+    rayQueue.Reserve(16 + (size_t)width * height * 5 * sizeof(vec4));     // a QueuedRay is 5 vec4s, at 16 in std430
+}
+
+// Scales the resolution of the render targets so that the frame time approaches targetMsec, the targets are stretched
+// to the window. The ray casting cost is about linear in the pixel count, the scale of a side goes with its square root.
+class ResolutionController {
+    float targetMsec, minScale;
+    float scale = 1;                // of a window side
+    float meanMsec = 0;
+    int nFrames = 0;                // since the last change, the first ones pay for new targets and path cache
+    bool enabled = true;
+public:
+    ResolutionController(float _targetMsec, float _minScale) { targetMsec = _targetMsec; minScale = _minScale; }
+    bool Update(float frameMsec) {      // true if the scale changed
+        meanMsec = (nFrames == 0) ? frameMsec : meanMsec * 0.8f + frameMsec * 0.2f;
+        if (!enabled || ++nFrames < 10) return false;
+        float ratio = targetMsec / meanMsec;
+        if (ratio > 0.85f && ratio < 1.15f) return false;
+        float newScale = std::max(minScale, std::min(1.0f, scale * std::max(0.7f, std::min(1.4f, sqrtf(ratio)))));
+        if (fabsf(newScale - scale) < 0.02f) return false;
+        scale = newScale;
+        nFrames = 0;
+        return true;
+    }
+    int scaled(int size) const { return scale >= 1 ? size : std::max(8, (int)(size * scale) / 8 * 8); }
+    void setEnabled(bool on) {
+        enabled = on;
+        if (!on) scale = 1;
+        nFrames = 0;
+    }
+    bool getEnabled() const { return enabled; }
+};
+ResolutionController resolution(1000.0f / 30, 0.25f);
+int screenWidth = windowWidth, screenHeight = windowHeight;     // of the window, changed by onReshape
+
+void resizeTargets() {
+    int width = resolution.scaled(screenWidth), height = resolution.scaled(screenHeight);
+    if (width == accumulationTargets[0].getWidth() && height == accumulationTargets[0].getHeight()) return;
+    accumulationTargets[0].Create(width, height);
+    accumulationTargets[1].Create(width, height);
+    if (scene.getCheckerboard()) tracedTarget.Create((width + 1) / 2, height, 2);
+    if (wavefront) createWavefrontTargets(width, height);
+    if (computeAvailable) createComputeTargets(width, height);
+    previousFrameValid = false;
+    scene.setResolution(width, height);
+}
+
+// The passes of the wavefront tracer into the accumulation target, the ray state is read through the units 17 to 24.
+// The time of each bounce is measured with a timer query, read in the next frame if it is ready by then, and the
+// averages are printed every 30 frames read.
+void traceWavefront(RenderTarget& target) {
+    glEnable(GL_STENCIL_TEST);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    rayStates[0].Use();
+    glClearStencil(1);
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glStencilFunc(GL_ALWAYS, 1, 0xff);
+    scene.SetWavefrontUniform(intersectProgram, shadeProgram, resolveProgram);
+    shadeProgram.Use();
+    eyePass.Set(1);
+    fullScreenTexturedQuad.Draw();
+    glStencilFunc(GL_EQUAL, 1, 0xff);       // the live rays
+    int depth = scene.getMaxDepth();
+    int querySet = wavefrontFrame % 2, lastSet = 1 - querySet;
+    for (int d = 0; d < depth; d++) {
+        RenderTarget &from = rayStates[d % 2], &to = rayStates[1 - d % 2];
+        glBeginQuery(GL_TIME_ELAPSED, bounceQueries[querySet][d]);
+        for (int k = 0; k < 4; k++) from.Bind(17 + k, k);
+        hitTarget.Use();
+        intersectProgram.Use();
+        intersectBounce.Set(d);
+        fullScreenTexturedQuad.Draw();
+        hitTarget.Bind(21, 0);
+        hitTarget.Bind(22, 1);
+        to.Use();
+        shadeProgram.Use();
+        eyePass.Set(0);
+        shadeBounce.Set(d);
+        fullScreenTexturedQuad.Draw();
+        if (d < depth - 1) {
+            to.Bind(17, 0);
+            from.Use();                     // for its stencil only
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+            killProgram.Use();
+            fullScreenTexturedQuad.Draw();
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+    glDisable(GL_STENCIL_TEST);
+    RenderTarget &last = rayStates[depth % 2], &other = rayStates[1 - depth % 2];
+    last.Bind(17, 0);
+    last.Bind(20, 3);
+    other.Bind(23, 0);
+    other.Bind(24, 3);
+    target.Use();
+    resolveProgram.Use();
+    fullScreenTexturedQuad.Draw();
+    gpuProgram.Use();
+
+    queriedDepth[querySet] = depth;
+    wavefrontFrame++;
+
+    int n = queriedDepth[lastSet];
+    GLint available = 0;            // the queries end in order, the last one of the set is ready after the others
+    if (n > 0) glGetQueryObjectiv(bounceQueries[lastSet][n - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;         // the GPU is more than a frame behind, this frame is not counted
+    for (int d = 0; d < n; d++) {
+        GLuint64 nsec = 0;
+        glGetQueryObjectui64v(bounceQueries[lastSet][d], GL_QUERY_RESULT, &nsec);
+        bounceMsec[d] += nsec * 1e-6;
+        bounceFrames[d]++;
+    }
+    queriedDepth[lastSet] = 0;
+    if (++nWavefrontFrames < 30) return;
+    printf("\nwavefront msec per bounce:");
+    for (int d = 0; d < maxBounces && bounceFrames[d] > 0; d++) printf(" %.1f", bounceMsec[d] / bounceFrames[d]);
+    printf("\n");
+    for (int d = 0; d < maxBounces; d++) { bounceMsec[d] = 0; bounceFrames[d] = 0; }
+    nWavefrontFrames = 0;
+}
+
+// The eye rays by tiles of 16 x 16, as Scene::tileSize, then the queued rays by the persistent threads
+void traceCompute(RenderTarget& target) {
+    int width = target.getWidth(), height = target.getHeight();
+    computeProgram.Use();
+    scene.SetComputeUniform();
+    unsigned int counters[2] = { 0, 0 };
+    rayQueue.Upload(counters, sizeof(counters));
+    rayQueue.Bind();
+    target.BindImage(0);
+    computePass.Set(0);
+    glDispatchCompute((width + 15) / 16, (height + 15) / 16, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    computePass.Set(1);
+    glDispatchCompute(persistentGroups, 1, 1);
+    glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    gpuProgram.Use();
+}
+
+const char * tracerName() {     // of the backend onDisplay runs
+    if (scene.getVirtualImages() || (!computeTracer && !wavefront)) return "fragment shader";
+    return computeTracer ? "compute shader" : "wavefront";
+}
+
+// not in framework.cpp, registered by onInitialization
+void onReshape(int width, int height) {
+    screenWidth = std::max(width, 1);
+    screenHeight = std::max(height, 1);
+    glViewport(0, 0, screenWidth, screenHeight);
+    scene.setAspect((float)screenWidth / screenHeight);
+    resizeTargets();
+}
 int lasttime;
 // Initialization, create an OpenGL context
 void onInitialization() {
     glViewport(0, 0, windowWidth, windowHeight);
     scene.build();
     fullScreenTexturedQuad.Create();
+    resizeTargets();
 
     // create program for the GPU
-    gpuProgram.Create(vertexSource, fragmentSource, "fragmentColor");
+    reconstructProgram.Create(vertexSource, reconstructSource, "fragmentColor");
+    reconstructProgram.Use();
+    reconstructProgram.getUniform<int>("previous").Set(11);
+    reconstructProgram.getUniform<int>("traced").Set(13);
+    reconstructProgram.getUniform<int>("tracedMotion").Set(14);
+    reconstructParity = reconstructProgram.getUniform<int>("tracedParity");
+    killProgram.Create(vertexSource, killSource, "fragmentColor");
+    killProgram.Use();
+    killProgram.getUniform<int>("rayStart").Set(17);
+    gpuProgram.Create(vertexSource, fragmentVariant("").c_str(), "fragmentColor");
+    gpuProgram.Use();
+    scene.Create(gpuProgram);
+    intersectProgram.Create(vertexSource, fragmentVariant("#define WAVEFRONT 1\n").c_str(), "hitNormalOut");
+    intersectBounce = intersectProgram.getUniform<int>("bounce");
+    const char * stateSamplers[] = { "rayStart", "rayDir", "rayWeight", "rayRadiance", "hitNormal", "hitMaterial" };
+    for (int k = 0; k < 2; k++) intersectProgram.getUniform<int>(stateSamplers[k]).Set(17 + k);
+    shadeProgram.Create(vertexSource, fragmentVariant("#define WAVEFRONT 2\n").c_str(), "rayStartOut");
+    shadeBounce = shadeProgram.getUniform<int>("bounce");
+    eyePass = shadeProgram.getUniform<int>("eyePass");
+    for (int k = 0; k < 6; k++) shadeProgram.getUniform<int>(stateSamplers[k]).Set(17 + k);
+    resolveProgram.Create(vertexSource, resolveSource, "fragmentColor");
+    resolveProgram.getUniform<int>("rayStart").Set(17);
+    resolveProgram.getUniform<int>("rayRadiance").Set(20);
+    resolveProgram.getUniform<int>("otherStart").Set(23);
+    resolveProgram.getUniform<int>("otherRadiance").Set(24);
+    scene.CreateWavefront(intersectProgram, shadeProgram, resolveProgram);
     gpuProgram.Use();
-    int location = glGetUniformLocation(gpuProgram.getId(), "isGold");
-    if (location >= 0) glUniform1i(location, true); else printf("uniform isGold cannot be set\n");
+    computeAvailable = hasComputeShaders();
+    if (computeAvailable) {
+        computeProgram.CreateCompute(computeVariant().c_str());
+        computePass = computeProgram.getUniform<int>("computePass");
+        scene.CreateCompute(computeProgram);
+        rayQueue.Create(6);
+        createComputeTargets(accumulationTargets[0].getWidth(), accumulationTargets[0].getHeight());
+        gpuProgram.Use();
+    }
+    printf("%s, compute shaders %s\n", (const char *)glGetString(GL_VERSION), computeAvailable ? "available" : "not available");
+    glGenQueries(2 * maxBounces, bounceQueries[0]);
+    glutReshapeFunc(onReshape);
 }
 
 // Window has become invalid: Redraw
@@ -460,12 +2283,49 @@ void onDisplay() {
     nFrames++;
     static long tStart = glutGet(GLUT_ELAPSED_TIME);
     long tEnd = glutGet(GLUT_ELAPSED_TIME);
-    printf("%d msec\r", (tEnd - tStart) / nFrames);
+    static long tLast = tEnd;
 
     glClearColor(1.0f, 0.5f, 0.8f, 1.0f);							// background color
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
-    scene.SetUniform(gpuProgram.getId());
-    fullScreenTexturedQuad.Draw();
+    scene.SetUniform();
+    printf("%d msec, %d uploads of %d bytes, %d ring bytes, %d stalls, %d refits of %.1f us, %d rebuilds of %.1f us\r", (tEnd - tStart) / nFrames,
+           scene.getUploadCount(), (int)scene.getUploadedBytes(), (int)scene.getRingBytes(), scene.getStallCount(),
+           scene.getRefitCount(), scene.getRefitUsec(), scene.getRebuildCount(), scene.getRebuildUsec());
+    static int current = 0;         // the accumulation target drawn last
+    int n = scene.getSampleCount();
+    if (n < maxSamples) {
+        if (resolution.Update((float)(tEnd - tLast))) {     // only the frames drawing count
+            resizeTargets();
+            scene.SetUniform();     // new path cache
+            n = 0;
+        }
+        current = 1 - current;
+        RenderTarget& target = accumulationTargets[current];
+        accumulationTargets[1 - current].Bind(11);       // the previous mean or frame
+        if (computeTracer && !scene.getVirtualImages()) traceCompute(target);
+        else if (wavefront && !scene.getVirtualImages()) traceWavefront(target);
+        else if (scene.getCheckerboard() && n == 0 && previousFrameValid) {
+            int parity = nFrames % 2;
+            scene.setTracedParity(parity);
+            tracedTarget.Use();
+            fullScreenTexturedQuad.Draw();
+            scene.setTracedParity(-1);
+            reconstructProgram.Use();
+            reconstructParity.Set(parity);
+            tracedTarget.Bind(13, 0);
+            tracedTarget.Bind(14, 1);
+            target.Use();
+            fullScreenTexturedQuad.Draw();
+            gpuProgram.Use();
+        } else {
+            target.Use();
+            fullScreenTexturedQuad.Draw();
+        }
+        previousFrameValid = true;
+        target.BlitToScreen(screenWidth, screenHeight);
+        scene.EndFrame();
+    } else accumulationTargets[current].BlitToScreen(screenWidth, screenHeight);     // converged
+    tLast = tEnd;
     glutSwapBuffers();									// exchange the two buffers
 }
 
@@ -475,17 +2335,86 @@ void onKeyboard(unsigned char key, int pX, int pY) {
 
 // Key of ASCII code released
 void onKeyboardUp(unsigned char key, int pX, int pY) {
-    int location = glGetUniformLocation(gpuProgram.getId(), "isGold");
     switch(key){
         case 'a':
             scene.increaseMirrorNumber();
             break;
         case  'g':
-            if (location >= 0) glUniform1i(location, true); else printf("uniform isGold cannot be set\n");
+            scene.setMirrorMaterial(3);     // gold
             break;
         case 's':
-            if (location >= 0) glUniform1i(location, false); else printf("uniform isGold cannot be set\n");
+            scene.setMirrorMaterial(4);     // silver
+            break;
+        case 'v':
+            scene.setVirtualImages(!scene.getVirtualImages());
+            break;
+        case 'c':
+            scene.setPathCache(!scene.getPathCache());
+            break;
+        case 'l':
+            scene.setSlabGrid(!scene.getSlabGrid());
+            break;
+        case 'u':
+            scene.setTileCulling(!scene.getTileCulling());
+            break;
+        case 'b':
+            scene.setBounceView(!scene.getBounceView());
+            break;
+        case 'm':
+            scene.setShadowMap(!scene.getShadowMap());
+            break;
+        case 'p':
+            scene.setPaused(!scene.getPaused());
             break;
+        case 'k':       // checkerboard frames while the image changes
+            scene.setCheckerboard(!scene.getCheckerboard());
+            if (scene.getCheckerboard()) tracedTarget.Create((accumulationTargets[0].getWidth() + 1) / 2, accumulationTargets[0].getHeight(), 2);
+            else tracedTarget.Destroy();
+            break;
+        case 'w':       // wavefront tracer, the virtual images stay in one pass
+            wavefront = !wavefront;
+            if (wavefront) createWavefrontTargets(accumulationTargets[0].getWidth(), accumulationTargets[0].getHeight());
+            else {
+                rayStates[0].Destroy();
+                rayStates[1].Destroy();
+                hitTarget.Destroy();
+            }
+            scene.restartAccumulation();
+            printf("\n%s tracer\n", tracerName());
+            break;
+        case 'q':       // compute backend, the virtual images stay in the fragment shader
+            if (computeAvailable) {
+                computeTracer = !computeTracer;
+                scene.restartAccumulation();
+            } else printf("\ncompute shaders need GL 4.3 or ARB_compute_shader\n");
+            printf("\n%s tracer\n", tracerName());
+            break;
+        case 'd':       // dynamic resolution on and off
+            resolution.setEnabled(!resolution.getEnabled());
+            resizeTargets();
+            break;
+        case 'r':
+            scene.setRouletteWeight(scene.getRouletteWeight() > 0 ? 0 : 0.25f);
+            break;
+        case '+':
+            scene.setMaxDepth(scene.getMaxDepth() + 1);
+            break;
+        case '-':
+            scene.setMaxDepth(scene.getMaxDepth() - 1);
+            break;
+        case 't': {     // stress test: 10k, 100k and 1M spheres, then the original scene again
+            static const int stressSizes[] = { 10000, 100000, 1000000, 0 };
+            static int stressStep = 0;
+            int n = stressSizes[stressStep];
+            stressStep = (stressStep + 1) % 4;
+            long tStart = glutGet(GLUT_ELAPSED_TIME);
+            scene.buildStressTest(n);
+            scene.SetUniform();
+            glFinish();
+            printf("\nstress test: %d spheres, %d KB written in %d msec\n", n, (int)(scene.getRingBytes() + scene.getUploadedBytes()) / 1024,
+                   (int)(glutGet(GLUT_ELAPSED_TIME) - tStart));
+            break;
+        }
         default:
             break;
     }
@@ -0,0 +1,197 @@
+//=============================================================================================
+// Bounding volume hierarchy over spheres for the GPU ray caster. It is built on the CPU with binned SAH and
+// flattened in depth first order with skip pointers: the shader walks the nodes without a stack, it goes to
+// the next node when the ray hits a box and jumps to the skip node, the one after the subtree, when it misses.
+//=============================================================================================
+#pragma once
+#include "framework.h"
+#include <algorithm>
+#include <string.h>
+
+//--------------------------
+struct AABB {
+//--------------------------
+	vec3 lo, hi;
+
+	AABB() : lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f) {}
+
+	void grow(const vec3& p) {
+		lo = vec3(fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z));
+		hi = vec3(fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z));
+	}
+
+	void grow(const AABB& b) { grow(b.lo); grow(b.hi); }
+
+	float area() const {	// surface area, 0 for an empty box
+		vec3 d = hi - lo;
+		if (d.x < 0) return 0;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+//--------------------------
+struct BVHNode {
+//--------------------------
+	AABB bounds;
+	int skip;				// node after the subtree, where the traversal goes when the ray misses the box
+	int first, count;		// leaves: spheres [first, first + count) in BVH order, inner nodes: count = 0
+};
+
+//--------------------------
+class SphereBVH {
+//--------------------------
+	static const int maxLeafSize = 4;
+	static const int nBins = 12;
+
+	std::vector<BVHNode> nodes;		// depth first: the left child of node i is i + 1, the right child is nodes[i + 1].skip
+	std::vector<int> order;			// sphere index of each BVH slot
+	std::vector<AABB> sphereBounds;
+	std::vector<vec3> centroids;
+	float builtCost = 0;			// SAH cost right after the last Build
+
+	static float axis(const vec3& v, int a) { return (&v.x)[a]; }
+
+	void makeLeaf(BVHNode& node, int first, int last) {
+		node.first = first;
+		node.count = last - first;
+	}
+
+	// SAH split of order[first, last) on the longest centroid axis, returns the first slot of the right half or -1 for a leaf
+	int split(int first, int last, const AABB& bounds) {
+		int count = last - first;
+		AABB centroidBounds;
+		for (int i = first; i < last; i++) centroidBounds.grow(centroids[order[i]]);
+		vec3 extent = centroidBounds.hi - centroidBounds.lo;
+		int a = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		float lo = axis(centroidBounds.lo, a), size = axis(extent, a);
+		if (size <= 0) return count > maxLeafSize ? first + count / 2 : -1;	// coinciding centers: halve by count
+
+		int binCount[nBins] = { 0 };
+		AABB binBounds[nBins];
+		for (int i = first; i < last; i++) {
+			int b = std::min(nBins - 1, (int)(nBins * (axis(centroids[order[i]], a) - lo) / size));
+			binCount[b]++;
+			binBounds[b].grow(sphereBounds[order[i]]);
+		}
+		float rightCost[nBins];		// area * count of bins [b, nBins)
+		AABB rightBounds;
+		int rightCount = 0;
+		for (int b = nBins - 1; b > 0; b--) {
+			rightBounds.grow(binBounds[b]);
+			rightCount += binCount[b];
+			rightCost[b] = rightBounds.area() * rightCount;
+		}
+		AABB leftBounds;
+		int leftCount = 0, bestBin = -1;
+		float bestCost = 1e30f;
+		for (int b = 1; b < nBins; b++) {
+			leftBounds.grow(binBounds[b - 1]);
+			leftCount += binCount[b - 1];
+			float cost = leftBounds.area() * leftCount + rightCost[b];
+			if (leftCount > 0 && leftCount < count && cost < bestCost) { bestCost = cost; bestBin = b; }
+		}
+		if (bestBin < 0 || (count <= maxLeafSize && bestCost >= bounds.area() * count)) return count > maxLeafSize ? first + count / 2 : -1;
+
+		int * mid = std::partition(&order[0] + first, &order[0] + last, [&](int s) {
+			return std::min(nBins - 1, (int)(nBins * (axis(centroids[s], a) - lo) / size)) < bestBin;
+		});
+		return (int)(mid - &order[0]);
+	}
+
+	void setSpheres(const std::vector<vec4>& spheres) {
+		int n = (int)spheres.size();
+		sphereBounds.resize(n);
+		centroids.resize(n);
+		for (int s = 0; s < n; s++) {
+			centroids[s] = vec3(spheres[s].x, spheres[s].y, spheres[s].z);
+			vec3 r(spheres[s].w, spheres[s].w, spheres[s].w);
+			sphereBounds[s].lo = centroids[s] - r;
+			sphereBounds[s].hi = centroids[s] + r;
+		}
+	}
+
+	void build(int first, int last) {
+		int n = (int)nodes.size();
+		nodes.push_back(BVHNode());
+		AABB bounds;
+		for (int i = first; i < last; i++) bounds.grow(sphereBounds[order[i]]);
+		nodes[n].bounds = bounds;
+		makeLeaf(nodes[n], first, last);
+		int mid = (last - first > 1) ? split(first, last, bounds) : -1;
+		if (mid > first && mid < last) {
+			nodes[n].count = 0;
+			build(first, mid);
+			build(mid, last);
+		}
+		nodes[n].skip = (int)nodes.size();
+	}
+public:
+	void Build(const std::vector<vec4>& spheres) {	// vec4(center, radius) of each sphere
+		int n = (int)spheres.size();
+		setSpheres(spheres);
+		nodes.clear();
+		order.resize(n);
+		for (int s = 0; s < n; s++) order[s] = s;
+		nodes.reserve(2 * n / maxLeafSize + 1);
+		if (n > 0) build(0, n);
+		builtCost = Cost();
+	}
+
+	// New sphere positions with the same topology and order, the boxes are recomputed bottom-up: the children
+	// of a node come after it, so one backward pass is enough
+	void Refit(const std::vector<vec4>& spheres) {
+		setSpheres(spheres);
+		for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+			BVHNode& node = nodes[i];
+			AABB bounds;
+			if (node.count > 0) {
+				for (int s = node.first; s < node.first + node.count; s++) bounds.grow(sphereBounds[order[s]]);
+			} else {
+				bounds = nodes[i + 1].bounds;
+				bounds.grow(nodes[nodes[i + 1].skip].bounds);
+			}
+			node.bounds = bounds;
+		}
+	}
+
+	// Expected box and sphere tests of a random ray hitting the root, a refitted tree gets worse as the spheres mix
+	float Cost() const {
+		if (nodes.empty() || nodes[0].bounds.area() <= 0) return 0;
+		float cost = 0;
+		for (size_t i = 0; i < nodes.size(); i++) cost += nodes[i].bounds.area() * (nodes[i].count > 0 ? 1 + nodes[i].count : 1);
+		return cost / nodes[0].bounds.area();
+	}
+
+	// Refits and rebuilds only when the cost has grown by more than maxGrowth since the last build, returns true if rebuilt
+	bool Update(const std::vector<vec4>& spheres, float maxGrowth = 1.5f) {
+		if ((int)spheres.size() != (int)order.size()) { Build(spheres); return true; }
+		Refit(spheres);
+		if (Cost() <= builtCost * maxGrowth) return false;
+		Build(spheres);
+		return true;
+	}
+
+	const std::vector<int>& getOrder() const { return order; }
+	const std::vector<BVHNode>& getNodes() const { return nodes; }
+
+	// 2 texels per node: vec4(lo, skip) and vec4(hi, first * 8 + count), the w components hold the bits of the ints,
+	// the shader reads them back with floatBitsToInt, so they stay exact for any number of spheres.
+	// The boxes are grown by a relative epsilon, so the rounding of the slab test cannot miss a grazing sphere hit.
+	void Pack(vec4 * texels) const {
+		for (size_t i = 0; i < nodes.size(); i++) {
+			const BVHNode& node = nodes[i];
+			vec3 lo = node.bounds.lo, hi = node.bounds.hi;
+			vec3 eps = vec3(fabsf(lo.x) + fabsf(hi.x), fabsf(lo.y) + fabsf(hi.y), fabsf(lo.z) + fabsf(hi.z)) * 1e-5f;
+			lo = lo - eps;
+			hi = hi + eps;
+			texels[2 * i] = vec4(lo.x, lo.y, lo.z, intBits(node.skip));
+			texels[2 * i + 1] = vec4(hi.x, hi.y, hi.z, intBits(node.count > 0 ? node.first * 8 + node.count : 0));
+		}
+	}
+private:
+	static float intBits(int i) {
+		float f;
+		memcpy(&f, &i, sizeof(float));
+		return f;
+	}
+};
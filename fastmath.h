@@ -0,0 +1,223 @@
+//=============================================================================================
+// Fast approximate sin/cos/tan, exp2, log2, pow and rsqrt for bulk CPU work: one SSE register (__m128) or a whole
+// floatN batch, which is what call sites should use. The scalar float versions are the reference the SIMD ones are
+// checked against bit by bit (checkFastMath in Benchmark.cpp) and the code for the tail of an array, not a faster
+// libm: one value at a time fastPow is 2-3x slower than powf, fastExp2 and fastLog2 are slower than exp2f and log2f.
+// The polynomials are the Cephes single precision ones.
+// Error bounds, measured by benchFastMath in Benchmark.cpp over these ranges against the double precision functions:
+//   fastSinCos, fastSin, fastCos  |x| <= 8192            absolute error < 1e-7
+//   fastTan                       |x| <= 8192            absolute error < 1.5e-7 / cos^2 x
+//   fastExp2                      -126 <= x <= 127        relative error < 1.5e-7
+//   fastLog2                      normalized x > 0        relative error < 2e-7, absolute < 2e-8 for |log2 x| < 0.1
+//   fastPow(x, y) = 2^(y log2 x)  x > 0                   relative error < (1 + 2 |y log2 x|) * 1.2e-7
+//   fastRsqrt                     normalized x > 0        relative error < 3e-7 (rsqrtps + one Newton step)
+// Out of range inputs are clamped (exp2), give -inf / NaN (log2 of 0 / negative) or lose precision (sin, cos).
+//=============================================================================================
+#pragma once
+#include <string.h>
+#include "vecbatch.h"
+
+namespace fastmath {
+	const float DP1 = 0.78515625f, DP2 = 2.4187564849853515625e-4f, DP3 = 3.77489497744594108e-8f;	// pi/4 in three parts
+	const float FOPI = 1.27323954473516f;	// 4 / pi
+
+	const float sinC0 = -1.9515295891e-4f, sinC1 = 8.3321608736e-3f, sinC2 = -1.6666654611e-1f;
+	const float cosC0 = 2.443315711809948e-5f, cosC1 = -1.388731625493765e-3f, cosC2 = 4.166664568298827e-2f;
+
+	const float exp2C[6] = { 1.535336188319500e-4f, 1.339887440266574e-3f, 9.618437357674640e-3f,
+	                         5.550332471162809e-2f, 2.402264791363012e-1f, 6.931472028550421e-1f };
+	const float logC[9] = { 7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f, -1.2420140846e-1f, 1.4249322787e-1f,
+	                        -1.6668057665e-1f, 2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f };
+	const float LOG2E = 1.44269504088896341f;
+	const float SQRTHF = 0.707106781186547524f;
+}
+
+//---------------------------------------------------------------------------------------------
+// scalar versions: the reference and the tails, see above
+//---------------------------------------------------------------------------------------------
+inline void fastSinCos(float x, float& s, float& c) {
+	using namespace fastmath;
+	float ax = fabsf(x);
+	int j = (int)(ax * FOPI);
+	j = (j + 1) & ~1;						// octant rounded to even: r is in [-pi/4, pi/4]
+	float y = (float)j;
+	float r = ((ax - y * DP1) - y * DP2) - y * DP3;
+	float z = r * r;
+	float ps = ((sinC0 * z + sinC1) * z + sinC2) * z * r + r;
+	float pc = ((cosC0 * z + cosC1) * z + cosC2) * z * z - 0.5f * z + 1;
+	int q = j >> 1;							// quadrant
+	float sv = (q & 1) ? pc : ps, cv = (q & 1) ? ps : pc;
+	s = ((q & 2) ? -sv : sv) * (signbit(x) ? -1.0f : 1.0f);	// sin(-0) = -0, as the sign bit flip of the SIMD code
+	c = ((q + 1) & 2) ? -cv : cv;
+}
+
+inline float fastSin(float x) { float s, c; fastSinCos(x, s, c); return s; }
+inline float fastCos(float x) { float s, c; fastSinCos(x, s, c); return c; }
+inline float fastTan(float x) { float s, c; fastSinCos(x, s, c); return s / c; }
+
+inline float fastExp2(float x) {
+	using namespace fastmath;
+	if (x > 127) x = 127;
+	if (x < -126) x = -126;
+	float i = floorf(x + 0.5f);
+	float f = x - i;						// [-0.5, 0.5]
+	float p = ((((exp2C[0] * f + exp2C[1]) * f + exp2C[2]) * f + exp2C[3]) * f + exp2C[4]) * f + exp2C[5];
+	p = p * f + 1;
+	int bits = ((int)i + 127) << 23;		// 2^i
+	float scale;
+	memcpy(&scale, &bits, sizeof(float));
+	return p * scale;
+}
+
+inline float fastLog2(float x) {
+	using namespace fastmath;
+	if (x <= 0) return x == 0 ? -INFINITY : NAN;
+	int bits;
+	memcpy(&bits, &x, sizeof(float));
+	int e = ((bits >> 23) & 0xff) - 126;
+	bits = (bits & 0x807fffff) | 0x3f000000;	// mantissa in [0.5, 1)
+	float m;
+	memcpy(&m, &bits, sizeof(float));
+	if (m < SQRTHF) { e -= 1; m = m + m - 1; }
+	else m = m - 1;
+	float z = m * m;
+	float p = logC[0];
+	for (int k = 1; k < 9; k++) p = p * m + logC[k];
+	float y = p * m * z - 0.5f * z;			// ln(1 + m) - m
+	return (y + m) * LOG2E + (float)e;
+}
+
+inline float fastPow(float x, float y) {
+	if (x <= 0) return x == 0 ? (y > 0 ? 0.0f : INFINITY) : NAN;
+	return fastExp2(y * fastLog2(x));
+}
+
+inline float fastRsqrt(float x) {
+#if FRAMEWORK_SIMD
+	__m128 v = _mm_set_ss(x);
+	__m128 r = _mm_rsqrt_ss(v);				// 12 bit estimate refined with one Newton step
+	r = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), r), _mm_sub_ss(_mm_set_ss(3), _mm_mul_ss(_mm_mul_ss(v, r), r)));
+	return _mm_cvtss_f32(r);
+#else
+	return 1 / sqrtf(x);
+#endif
+}
+
+#if FRAMEWORK_SIMD
+//---------------------------------------------------------------------------------------------
+// 4 lanes in an SSE register (SSE2 only)
+//---------------------------------------------------------------------------------------------
+inline __m128 fastSelect(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+inline void fastSinCos(__m128 x, __m128& s, __m128& c) {
+	using namespace fastmath;
+	__m128 signBit = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000));
+	__m128 xSign = _mm_and_ps(x, signBit);
+	__m128 ax = _mm_andnot_ps(signBit, x);
+	__m128i j = _mm_cvttps_epi32(_mm_mul_ps(ax, _mm_set1_ps(FOPI)));
+	j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+	__m128 y = _mm_cvtepi32_ps(j);
+	__m128 r = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(ax, _mm_mul_ps(y, _mm_set1_ps(DP1))), _mm_mul_ps(y, _mm_set1_ps(DP2))), _mm_mul_ps(y, _mm_set1_ps(DP3)));
+	__m128 z = _mm_mul_ps(r, r);
+	__m128 ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(sinC0), z), _mm_set1_ps(sinC1)), z), _mm_set1_ps(sinC2)), z), r), r);
+	__m128 pc = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(cosC0), z), _mm_set1_ps(cosC1)), z), _mm_set1_ps(cosC2)), z), z),
+		_mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_set1_ps(1));
+	__m128i q = _mm_srli_epi32(j, 1);
+	__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+	__m128 sv = fastSelect(swap, pc, ps), cv = fastSelect(swap, ps, pc);
+	__m128 sNeg = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+	__m128 cNeg = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+	s = _mm_xor_ps(_mm_xor_ps(sv, sNeg), xSign);
+	c = _mm_xor_ps(cv, cNeg);
+}
+
+inline __m128 fastExp2(__m128 x) {
+	using namespace fastmath;
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126)), _mm_set1_ps(127));
+	__m128 h = _mm_add_ps(x, _mm_set1_ps(0.5f));
+	__m128i ii = _mm_cvttps_epi32(h);		// floor(x + 0.5)
+	__m128 i = _mm_cvtepi32_ps(ii);
+	__m128 fix = _mm_cmpgt_ps(i, h);
+	i = _mm_sub_ps(i, _mm_and_ps(fix, _mm_set1_ps(1)));
+	ii = _mm_cvtps_epi32(i);
+	__m128 f = _mm_sub_ps(x, i);
+	__m128 p = _mm_set1_ps(exp2C[0]);
+	for (int k = 1; k < 6; k++) p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(exp2C[k]));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1));
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ii, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(p, scale);
+}
+
+inline __m128 fastLog2(__m128 x) {
+	using namespace fastmath;
+	__m128 invalid = _mm_cmplt_ps(x, _mm_setzero_ps()), zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+	__m128i bits = _mm_castps_si128(x);
+	__m128i e = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)), _mm_set1_epi32(126));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32((int)0x807fffff)), _mm_set1_epi32(0x3f000000)));
+	__m128 small = _mm_cmplt_ps(m, _mm_set1_ps(SQRTHF));
+	__m128 ef = _mm_sub_ps(_mm_cvtepi32_ps(e), _mm_and_ps(small, _mm_set1_ps(1)));
+	m = _mm_sub_ps(_mm_add_ps(m, _mm_and_ps(small, m)), _mm_set1_ps(1));
+	__m128 z = _mm_mul_ps(m, m);
+	__m128 p = _mm_set1_ps(logC[0]);
+	for (int k = 1; k < 9; k++) p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(logC[k]));
+	__m128 y = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(p, m), z), _mm_mul_ps(_mm_set1_ps(0.5f), z));
+	__m128 r = _mm_add_ps(_mm_mul_ps(_mm_add_ps(y, m), _mm_set1_ps(LOG2E)), ef);
+	r = fastSelect(zero, _mm_set1_ps(-INFINITY), r);
+	return _mm_or_ps(r, invalid);			// all bits set is a NaN
+}
+
+inline __m128 fastPow(__m128 x, __m128 y) {
+	__m128 zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+	__m128 zeroPow = fastSelect(_mm_cmpgt_ps(y, _mm_setzero_ps()), _mm_setzero_ps(), _mm_set1_ps(INFINITY));
+	__m128 r = fastSelect(zero, zeroPow, fastExp2(_mm_mul_ps(y, fastLog2(x))));
+	return _mm_or_ps(r, _mm_cmplt_ps(x, _mm_setzero_ps()));	// NaN for negative x
+}
+
+inline __m128 fastRsqrt(__m128 x) {
+	__m128 r = _mm_rsqrt_ps(x);
+	return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r), _mm_sub_ps(_mm_set1_ps(3), _mm_mul_ps(_mm_mul_ps(x, r), r)));
+}
+#endif
+
+//---------------------------------------------------------------------------------------------
+// floatN batches
+//---------------------------------------------------------------------------------------------
+#if FRAMEWORK_SIMD
+#define FASTMATH_LANES(simd, scalar) for (int i = 0; i < N / 4; i++) { simd; }
+#else
+#define FASTMATH_LANES(simd, scalar) for (int i = 0; i < N; i++) { scalar; }
+#endif
+
+template<int N> inline void fastSinCos(const floatN<N>& x, floatN<N>& s, floatN<N>& c) {
+	FASTMATH_LANES(fastSinCos(x.q[i], s.q[i], c.q[i]), fastSinCos(x.v[i], s.v[i], c.v[i]));
+}
+
+template<int N> inline floatN<N> fastSin(const floatN<N>& x) { floatN<N> s, c; fastSinCos(x, s, c); return s; }
+template<int N> inline floatN<N> fastCos(const floatN<N>& x) { floatN<N> s, c; fastSinCos(x, s, c); return c; }
+template<int N> inline floatN<N> fastTan(const floatN<N>& x) { floatN<N> s, c; fastSinCos(x, s, c); return s / c; }
+
+template<int N> inline floatN<N> fastExp2(const floatN<N>& x) {
+	floatN<N> r;
+	FASTMATH_LANES(r.q[i] = fastExp2(x.q[i]), r.v[i] = fastExp2(x.v[i]));
+	return r;
+}
+
+template<int N> inline floatN<N> fastLog2(const floatN<N>& x) {
+	floatN<N> r;
+	FASTMATH_LANES(r.q[i] = fastLog2(x.q[i]), r.v[i] = fastLog2(x.v[i]));
+	return r;
+}
+
+template<int N> inline floatN<N> fastPow(const floatN<N>& x, const floatN<N>& y) {
+	floatN<N> r;
+	FASTMATH_LANES(r.q[i] = fastPow(x.q[i], y.q[i]), r.v[i] = fastPow(x.v[i], y.v[i]));
+	return r;
+}
+
+template<int N> inline floatN<N> fastRsqrt(const floatN<N>& x) {
+	floatN<N> r;
+	FASTMATH_LANES(r.q[i] = fastRsqrt(x.q[i]), r.v[i] = fastRsqrt(x.v[i]));
+	return r;
+}
+
+#undef FASTMATH_LANES
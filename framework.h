@@ -2,23 +2,42 @@
 // Szamitogepes grafika hazi feladat keret. Ervenyes 2018-tol.
 // TILOS megvaltoztatni
 //=============================================================================================
+#pragma once
 #define _USE_MATH_DEFINES		// M_PI
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
+#include <map>
+#include <string>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #else
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#define NOMINMAX				// keep min and max usable as function names
 #include <windows.h>
 #endif
 #include <GL/glew.h>		// must be downloaded 
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
 
+// SIMD back-end of the batch types and fast math (vecbatch.h, fastmath.h): compile with -DFRAMEWORK_SIMD=0 to get
+// the scalar code. vec2, vec3, vec4 and mat4 stay scalar: at -O3 the compiler vectorizes their operators itself, and
+// hand-written SSE and AVX versions measured no faster (see Benchmark.cpp)
+#ifndef FRAMEWORK_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRAMEWORK_SIMD 1
+#else
+#define FRAMEWORK_SIMD 0
+#endif
+#endif
+
+#if FRAMEWORK_SIMD
+#include <immintrin.h>
+#endif
+
 // Resolution of screen
 const unsigned int windowWidth = 600, windowHeight = 600;
 
@@ -54,6 +73,10 @@ inline float dot(const vec2& v1, const vec2& v2) {
 	return (v1.x * v2.x + v1.y * v2.y);
 }
 
+inline float cross(const vec2& v1, const vec2& v2) {	// > 0 if v2 is counterclockwise from v1
+	return v1.x * v2.y - v1.y * v2.x;
+}
+
 inline float length(const vec2& v) { return sqrtf(dot(v, v)); }
 
 inline vec2 normalize(const vec2& v) { return v * (1 / length(v)); }
@@ -179,10 +202,10 @@ struct vec4 {
 	}
 
 	void operator+=(const vec4 right) {
-		x += right.x; y += right.y; z += right.z, w += right.z;
+		x += right.x; y += right.y; z += right.z; w += right.w;
 	}
 
-	vec4 operator*(const mat4& mat) {
+	vec4 operator*(const mat4& mat) const {
 		return vec4(x * mat.m[0][0] + y * mat.m[1][0] + z * mat.m[2][0] + w * mat.m[3][0],
 			x * mat.m[0][1] + y * mat.m[1][1] + z * mat.m[2][1] + w * mat.m[3][1],
 			x * mat.m[0][2] + y * mat.m[1][2] + z * mat.m[2][2] + w * mat.m[3][2],
@@ -200,6 +223,103 @@ inline float dot(const vec4& v1, const vec4& v2) {
 	return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w);
 }
 
+inline bool isAffine(const mat4& m) { // last column is (0, 0, 0, 1), i.e. no projection
+	return m.m[0][3] == 0 && m.m[1][3] == 0 && m.m[2][3] == 0 && m.m[3][3] == 1;
+}
+
+inline mat4 transpose(const mat4& m) {
+	return mat4(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0],
+		        m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1],
+		        m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2],
+		        m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+}
+
+inline mat4 inverse(const mat4& m) { // general inverse with cofactors, the identity if m is singular
+	const float * a = &m.m[0][0];
+	float inv[16];
+	inv[0] = a[5] * a[10] * a[15] - a[5] * a[11] * a[14] - a[9] * a[6] * a[15] + a[9] * a[7] * a[14] + a[13] * a[6] * a[11] - a[13] * a[7] * a[10];
+	inv[4] = -a[4] * a[10] * a[15] + a[4] * a[11] * a[14] + a[8] * a[6] * a[15] - a[8] * a[7] * a[14] - a[12] * a[6] * a[11] + a[12] * a[7] * a[10];
+	inv[8] = a[4] * a[9] * a[15] - a[4] * a[11] * a[13] - a[8] * a[5] * a[15] + a[8] * a[7] * a[13] + a[12] * a[5] * a[11] - a[12] * a[7] * a[9];
+	inv[12] = -a[4] * a[9] * a[14] + a[4] * a[10] * a[13] + a[8] * a[5] * a[14] - a[8] * a[6] * a[13] - a[12] * a[5] * a[10] + a[12] * a[6] * a[9];
+	inv[1] = -a[1] * a[10] * a[15] + a[1] * a[11] * a[14] + a[9] * a[2] * a[15] - a[9] * a[3] * a[14] - a[13] * a[2] * a[11] + a[13] * a[3] * a[10];
+	inv[5] = a[0] * a[10] * a[15] - a[0] * a[11] * a[14] - a[8] * a[2] * a[15] + a[8] * a[3] * a[14] + a[12] * a[2] * a[11] - a[12] * a[3] * a[10];
+	inv[9] = -a[0] * a[9] * a[15] + a[0] * a[11] * a[13] + a[8] * a[1] * a[15] - a[8] * a[3] * a[13] - a[12] * a[1] * a[11] + a[12] * a[3] * a[9];
+	inv[13] = a[0] * a[9] * a[14] - a[0] * a[10] * a[13] - a[8] * a[1] * a[14] + a[8] * a[2] * a[13] + a[12] * a[1] * a[10] - a[12] * a[2] * a[9];
+	inv[2] = a[1] * a[6] * a[15] - a[1] * a[7] * a[14] - a[5] * a[2] * a[15] + a[5] * a[3] * a[14] + a[13] * a[2] * a[7] - a[13] * a[3] * a[6];
+	inv[6] = -a[0] * a[6] * a[15] + a[0] * a[7] * a[14] + a[4] * a[2] * a[15] - a[4] * a[3] * a[14] - a[12] * a[2] * a[7] + a[12] * a[3] * a[6];
+	inv[10] = a[0] * a[5] * a[15] - a[0] * a[7] * a[13] - a[4] * a[1] * a[15] + a[4] * a[3] * a[13] + a[12] * a[1] * a[7] - a[12] * a[3] * a[5];
+	inv[14] = -a[0] * a[5] * a[14] + a[0] * a[6] * a[13] + a[4] * a[1] * a[14] - a[4] * a[2] * a[13] - a[12] * a[1] * a[6] + a[12] * a[2] * a[5];
+	inv[3] = -a[1] * a[6] * a[11] + a[1] * a[7] * a[10] + a[5] * a[2] * a[11] - a[5] * a[3] * a[10] - a[9] * a[2] * a[7] + a[9] * a[3] * a[6];
+	inv[7] = a[0] * a[6] * a[11] - a[0] * a[7] * a[10] - a[4] * a[2] * a[11] + a[4] * a[3] * a[10] + a[8] * a[2] * a[7] - a[8] * a[3] * a[6];
+	inv[11] = -a[0] * a[5] * a[11] + a[0] * a[7] * a[9] + a[4] * a[1] * a[11] - a[4] * a[3] * a[9] - a[8] * a[1] * a[7] + a[8] * a[3] * a[5];
+	inv[15] = a[0] * a[5] * a[10] - a[0] * a[6] * a[9] - a[4] * a[1] * a[10] + a[4] * a[2] * a[9] + a[8] * a[1] * a[6] - a[8] * a[2] * a[5];
+
+	float det = a[0] * inv[0] + a[1] * inv[4] + a[2] * inv[8] + a[3] * inv[12];
+	if (det == 0) {
+		printf("singular matrix cannot be inverted\n");
+		return mat4(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+	}
+	float s = 1 / det;
+	return mat4(inv[0] * s, inv[1] * s, inv[2] * s, inv[3] * s,
+		        inv[4] * s, inv[5] * s, inv[6] * s, inv[7] * s,
+		        inv[8] * s, inv[9] * s, inv[10] * s, inv[11] * s,
+		        inv[12] * s, inv[13] * s, inv[14] * s, inv[15] * s);
+}
+
+inline mat4 inverseAffine(const mat4& m) { // inverse of the upper 3x3 block, then the translation row t' = -t * A^-1
+	float c00 = m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1];
+	float c01 = m.m[0][2] * m.m[2][1] - m.m[0][1] * m.m[2][2];
+	float c02 = m.m[0][1] * m.m[1][2] - m.m[0][2] * m.m[1][1];
+	float det = m.m[0][0] * c00 + m.m[1][0] * c01 + m.m[2][0] * c02;
+	if (det == 0) {
+		printf("singular matrix cannot be inverted\n");
+		return mat4(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+	}
+	float s = 1 / det;
+	float i00 = c00 * s, i01 = c01 * s, i02 = c02 * s;
+	float i10 = (m.m[1][2] * m.m[2][0] - m.m[1][0] * m.m[2][2]) * s;
+	float i11 = (m.m[0][0] * m.m[2][2] - m.m[0][2] * m.m[2][0]) * s;
+	float i12 = (m.m[0][2] * m.m[1][0] - m.m[0][0] * m.m[1][2]) * s;
+	float i20 = (m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0]) * s;
+	float i21 = (m.m[0][1] * m.m[2][0] - m.m[0][0] * m.m[2][1]) * s;
+	float i22 = (m.m[0][0] * m.m[1][1] - m.m[0][1] * m.m[1][0]) * s;
+	float tx = m.m[3][0], ty = m.m[3][1], tz = m.m[3][2];
+	return mat4(i00, i01, i02, 0,
+		        i10, i11, i12, 0,
+		        i20, i21, i22, 0,
+		        -(tx * i00 + ty * i10 + tz * i20), -(tx * i01 + ty * i11 + tz * i21), -(tx * i02 + ty * i12 + tz * i22), 1);
+}
+
+inline mat4 mulAffine(const mat4& a, const mat4& b) { // a * b when both are affine: the last column is not computed
+	mat4 result;	// plain loops, the compiler vectorizes them better than hand written SSE
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 3; j++) result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+	}
+	for (int j = 0; j < 3; j++) result.m[3][j] += b.m[3][j];
+	result.m[0][3] = result.m[1][3] = result.m[2][3] = 0;
+	result.m[3][3] = 1;
+	return result;
+}
+
+// transforms n points (w = 1) or directions (w = 0) with the row vector convention p * m,
+// points are divided by w unless m is affine. out may be the same array as in.
+inline void transformVectors(const mat4& m, const vec3 * in, vec3 * out, int n, float w) {
+	bool project = !isAffine(m) && w != 0;
+	for (int i = 0; i < n; i++) {	// the compiler vectorizes this loop at -O3
+		vec4 r = vec4(in[i].x, in[i].y, in[i].z, w) * m;
+		if (project) r = r / r.w;
+		out[i] = vec3(r.x, r.y, r.z);
+	}
+}
+
+inline void transformPoints(const mat4& m, std::vector<vec3>& points) {
+	if (!points.empty()) transformVectors(m, &points[0], &points[0], (int)points.size(), 1);
+}
+
+inline void transformDirections(const mat4& m, std::vector<vec3>& directions) {
+	if (!directions.empty()) transformVectors(m, &directions[0], &directions[0], (int)directions.size(), 0);
+}
+
 //---------------------------
 struct Texture {
 //---------------------------
@@ -230,10 +350,430 @@ struct Texture {
 	}
 };
 
+// glUniform* for each value type of Uniform<T>
+inline void uploadUniform(int location, int value) { glUniform1i(location, value); }
+inline void uploadUniform(int location, bool value) { glUniform1i(location, value ? 1 : 0); }
+inline void uploadUniform(int location, float value) { glUniform1f(location, value); }
+inline void uploadUniform(int location, const vec2& value) { glUniform2fv(location, 1, &value.x); }
+inline void uploadUniform(int location, const vec3& value) { glUniform3fv(location, 1, &value.x); }
+inline void uploadUniform(int location, const vec4& value) { glUniform4fv(location, 1, &value.x); }
+inline void uploadUniform(int location, const mat4& value) { glUniformMatrix4fv(location, 1, GL_TRUE, &value.m[0][0]); }
+
+// GLSL types a Uniform<T> may be bound to, bool and int are interchangeable as glUniform1i sets both,
+// samplers are Uniform<int> set to their texture unit
+template<typename T> struct UniformType;
+template<> struct UniformType<int> {
+	static bool matches(GLenum type) {
+		return type == GL_INT || type == GL_BOOL || type == GL_SAMPLER_2D ||
+		       type == GL_SAMPLER_BUFFER || type == GL_INT_SAMPLER_BUFFER || type == GL_UNSIGNED_INT_SAMPLER_BUFFER;
+	}
+};
+template<> struct UniformType<bool> { static bool matches(GLenum type) { return type == GL_INT || type == GL_BOOL; } };
+template<> struct UniformType<float> { static bool matches(GLenum type) { return type == GL_FLOAT; } };
+template<> struct UniformType<vec2> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC2; } };
+template<> struct UniformType<vec3> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC3; } };
+template<> struct UniformType<vec4> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC4; } };
+template<> struct UniformType<mat4> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT4; } };
+
+//---------------------------
+template<typename T> class Uniform {	// handle of a uniform of the current program, see GPUProgram::getUniform
+//---------------------------
+	int location;
+public:
+	Uniform(int _location = -1) { location = _location; }
+
+	bool isValid() const { return location >= 0; }
+
+	void Set(const T& value) const {	// no name lookup, missing uniforms were reported when the handle was made
+		if (location >= 0) uploadUniform(location, value);
+	}
+};
+
+//---------------------------
+template<typename T> class UniformBlock {	// uniform buffer object holding one T, which mirrors a std140 block
+//---------------------------
+	unsigned int bufferId, bindingPoint;
+	int nUploads;				// glBufferSubData calls and bytes since ResetStats, to see what a frame sends
+	size_t uploadedBytes;
+public:
+	UniformBlock() { bufferId = 0; bindingPoint = 0; nUploads = 0; uploadedBytes = 0; }
+
+	void Create(unsigned int _bindingPoint) {
+		bindingPoint = _bindingPoint;
+		glGenBuffers(1, &bufferId);
+		glBindBuffer(GL_UNIFORM_BUFFER, bufferId);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(T), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, bufferId);
+	}
+
+	unsigned int getBindingPoint() const { return bindingPoint; }
+
+	void Upload(const T& data) { UploadRange(data, 0, sizeof(T)); }	// the whole block in one call
+
+	void UploadRange(const T& data, size_t offset, size_t size) {	// only bytes [offset, offset + size) of data
+		if (size == 0) return;
+		glBindBuffer(GL_UNIFORM_BUFFER, bufferId);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, size, (const char *)&data + offset);
+		nUploads++;
+		uploadedBytes += size;
+	}
+
+	void ResetStats() { nUploads = 0; uploadedBytes = 0; }
+	int getUploadCount() const { return nUploads; }
+	size_t getUploadedBytes() const { return uploadedBytes; }
+
+	~UniformBlock() { if (bufferId) glDeleteBuffers(1, &bufferId); }
+};
+
+inline bool hasBufferStorage() {	// ARB_buffer_storage, core in GL 4.4
+#if defined(__APPLE__)
+	return false;
+#else
+	return GLEW_ARB_buffer_storage != 0;
+#endif
+}
+
+// Compute shaders with shader storage buffers and image stores: core in GL 4.3, which the driver may give for the 3.3
+// context asked for, or the ARB extensions of them in a 3.3 context
+inline bool hasComputeShaders() {
+#if defined(__APPLE__)
+	return false;
+#else
+	return GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object &&
+		GLEW_ARB_shader_image_load_store && GLEW_ARB_shader_image_size && GLEW_ARB_shading_language_420pack);
+#endif
+}
+
+inline const char * computeShaderHeader() {	// the #version line, and the extensions when hasComputeShaders found them
+#if !defined(__APPLE__)
+	if (!GLEW_VERSION_4_3) return "#version 330\n"
+		"#extension GL_ARB_compute_shader : require\n"
+		"#extension GL_ARB_shader_storage_buffer_object : require\n"
+		"#extension GL_ARB_shader_image_load_store : require\n"
+		"#extension GL_ARB_shader_image_size : require\n"
+		"#extension GL_ARB_shading_language_420pack : require\n";
+#endif
+	return "#version 430\n";
+}
+
+//---------------------------
+class RingBuffer {	// per-frame dynamic data in nRegions regions, the CPU writes one while the GPU reads the others
+//---------------------------
+	unsigned int bufferId, bindingPoint;
+	GLenum target;
+	size_t regionSize;				// aligned to the offset alignment of glBindBufferRange
+	int nRegions, current;
+	bool persistent;				// one persistent mapping, else the storage is orphaned every frame
+	char * mapped;
+	std::vector<GLsync> fences;		// one per region, set when the GPU commands reading it have been issued
+	int nStalls;					// Map had to wait for the GPU
+public:
+	RingBuffer() { bufferId = 0; regionSize = 0; persistent = false; mapped = NULL; nStalls = 0; }
+
+	// GL_UNIFORM_BUFFER regions are bound to the binding point, other targets (GL_TEXTURE_BUFFER) are read at getOffset()
+	void Create(unsigned int _bindingPoint, size_t size, int _nRegions = 3, GLenum _target = GL_UNIFORM_BUFFER) {
+		Destroy();
+		bindingPoint = _bindingPoint;
+		target = _target;
+		int alignment = 256;
+		if (target == GL_UNIFORM_BUFFER) glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		regionSize = (size + alignment - 1) / alignment * alignment;
+		current = 0;
+		persistent = hasBufferStorage();
+		glGenBuffers(1, &bufferId);
+		glBindBuffer(target, bufferId);
+#if !defined(__APPLE__)
+		if (persistent) {
+			nRegions = _nRegions;
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(target, regionSize * nRegions, NULL, flags);
+			mapped = (char *)glMapBufferRange(target, 0, regionSize * nRegions, flags);
+			if (!mapped) { printf("persistent mapping failed, orphaning instead\n"); persistent = false; }
+		}
+#endif
+		if (!persistent) {			// the driver renames the storage on orphaning, a single region is enough
+			nRegions = 1;
+			glBufferData(target, regionSize, NULL, GL_STREAM_DRAW);
+		}
+		fences.assign(nRegions, (GLsync)0);
+	}
+
+	void * Map() {	// memory of the next region, waits only if the GPU still reads it. NULL: skip the writes and Unmap
+		current = (current + 1) % nRegions;
+		if (persistent) {
+			if (fences[current]) {
+				GLenum status = glClientWaitSync(fences[current], 0, 0);
+				if (status == GL_TIMEOUT_EXPIRED) {
+					nStalls++;
+					do status = glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+					while (status == GL_TIMEOUT_EXPIRED);
+				}
+				glDeleteSync(fences[current]);
+				fences[current] = 0;
+			}
+			return mapped + current * regionSize;
+		}
+		glBindBuffer(target, bufferId);
+		glBufferData(target, regionSize, NULL, GL_STREAM_DRAW);		// orphan the storage the GPU may still read
+		void * region = glMapBufferRange(target, 0, regionSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!region) printf("ring buffer region cannot be mapped\n");
+		return region;
+	}
+
+	void Unmap() {	// after the writes since Map, then the region is bound for the next draw calls
+		if (!persistent) {
+			glBindBuffer(target, bufferId);
+			glUnmapBuffer(target);
+		}
+		if (target == GL_UNIFORM_BUFFER) glBindBufferRange(target, bindingPoint, bufferId, current * regionSize, regionSize);
+	}
+
+	unsigned int getBufferId() const { return bufferId; }
+	void BindStorage(unsigned int storageBindingPoint) {	// all regions as a shader storage block, read at getOffset()
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, storageBindingPoint, bufferId);
+	}
+	size_t getRegionSize() const { return regionSize; }
+	int getRegionCount() const { return nRegions; }
+	size_t getOffset() const { return current * regionSize; }	// of the region written last
+
+	void Fence() {	// after the draw calls reading the current region, it may be read in several frames
+		if (!persistent || !bufferId) return;
+		if (fences[current]) glDeleteSync(fences[current]);
+		fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	int getStallCount() const { return nStalls; }
+
+	void Destroy() {
+		for (size_t i = 0; i < fences.size(); i++) if (fences[i]) glDeleteSync(fences[i]);
+		fences.clear();
+		if (bufferId) glDeleteBuffers(1, &bufferId);	// unmaps a persistent mapping too
+		bufferId = 0;
+		mapped = NULL;
+	}
+
+	~RingBuffer() { Destroy(); }
+};
+
+//---------------------------
+class TextureBuffer {	// buffer texture, samplerBuffer in GLSL, for arrays too large for a uniform block
+//---------------------------
+	unsigned int bufferId, textureId;
+	GLenum format;					// texel format, e.g. GL_RGBA32F or GL_R32I
+	size_t capacity;				// bytes of the buffer store, it grows but never shrinks
+	int maxTexels;					// GL_MAX_TEXTURE_BUFFER_SIZE, queried once
+	int nUploads;
+	size_t uploadedBytes;
+public:
+	TextureBuffer() { bufferId = textureId = 0; capacity = 0; maxTexels = 0; nUploads = 0; uploadedBytes = 0; }
+
+	void Create(GLenum _format = GL_RGBA32F) {
+		format = _format;
+		glGenBuffers(1, &bufferId);
+		glGenTextures(1, &textureId);
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	}
+
+	// the texture reads another buffer instead of its own, e.g. a GL_TEXTURE_BUFFER RingBuffer
+	void Attach(unsigned int otherBufferId) {
+		glBindTexture(GL_TEXTURE_BUFFER, textureId);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, otherBufferId);
+	}
+
+	void Upload(const void * data, size_t bytes, size_t texelSize) {
+		if (bytes == 0) return;
+		glBindBuffer(GL_TEXTURE_BUFFER, bufferId);
+		if (bytes > capacity) {
+			if (bytes / texelSize > (size_t)maxTexels) printf("texture buffer of %d texels, only %d can be read\n", (int)(bytes / texelSize), maxTexels);
+			capacity = bytes;
+			glBufferData(GL_TEXTURE_BUFFER, capacity, data, GL_STATIC_DRAW);
+			Attach(bufferId);
+		}
+		else glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+		nUploads++;
+		uploadedBytes += bytes;
+	}
+
+	template<typename T> void Upload(const std::vector<T>& data) {
+		if (!data.empty()) Upload(&data[0], data.size() * sizeof(T), sizeof(T));
+	}
+
+	void Bind(unsigned int textureUnit) {
+		glActiveTexture(GL_TEXTURE0 + textureUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, textureId);
+	}
+
+	void BindStorage(unsigned int storageBindingPoint) {	// the same texels as a shader storage block, GL 4.3
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, storageBindingPoint, bufferId);
+	}
+
+	int getMaxTexels() const { return maxTexels; }
+	void ResetStats() { nUploads = 0; uploadedBytes = 0; }
+	int getUploadCount() const { return nUploads; }
+	size_t getUploadedBytes() const { return uploadedBytes; }
+
+	~TextureBuffer() {
+		if (textureId) glDeleteTextures(1, &textureId);
+		if (bufferId) glDeleteBuffers(1, &bufferId);
+	}
+};
+
+//---------------------------
+class StorageBuffer {	// shader storage buffer object written by compute shaders, a std430 block in GLSL, GL 4.3
+//---------------------------
+	unsigned int bufferId, bindingPoint;
+	size_t capacity;				// bytes of the buffer store, it grows but never shrinks
+public:
+	StorageBuffer() { bufferId = bindingPoint = 0; capacity = 0; }
+
+	void Create(unsigned int _bindingPoint) {
+		bindingPoint = _bindingPoint;
+		glGenBuffers(1, &bufferId);
+	}
+
+	void Reserve(size_t bytes) {	// the contents are lost when the store grows
+		if (bytes <= capacity) return;
+		capacity = bytes;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferId);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, capacity, NULL, GL_DYNAMIC_COPY);
+	}
+
+	void Upload(const void * data, size_t bytes, size_t offset = 0) {	// e.g. to reset counters
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferId);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, bytes, data);
+	}
+
+	void Bind() { glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, bufferId); }
+
+	~StorageBuffer() { if (bufferId) glDeleteBuffers(1, &bufferId); }
+};
+
+//---------------------------
+class RenderTarget {	// framebuffer object with up to four float color textures, sampler2D in GLSL, and a stencil
+//---------------------------
+	static const int maxColors = 4;
+	unsigned int framebufferId, textureIds[maxColors], stencilId;
+	int width, height, nColors;
+	bool ownsStencil;
+public:
+	RenderTarget() { framebufferId = stencilId = 0; width = height = nColors = 0; ownsStencil = false; }
+
+	// again for a new size, color attachment k is written by the fragment shader output at location k
+	void Create(int _width, int _height, int _nColors = 1) {
+		Destroy();
+		width = _width;
+		height = _height;
+		nColors = _nColors;
+		glGenTextures(nColors, textureIds);
+		glGenFramebuffers(1, &framebufferId);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
+		GLenum drawBuffers[maxColors];
+		for (int k = 0; k < nColors; k++) {
+			glBindTexture(GL_TEXTURE_2D, textureIds[k]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, GL_TEXTURE_2D, textureIds[k], 0);
+			drawBuffers[k] = GL_COLOR_ATTACHMENT0 + k;
+		}
+		glDrawBuffers(nColors, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("framebuffer of %dx%d is incomplete\n", width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// a depth-stencil buffer of its own, or the one of owner of the same size, so the passes into either see one mask
+	void CreateStencil(const RenderTarget * owner = NULL) {
+		if (owner) stencilId = owner->stencilId;
+		else {
+			glGenRenderbuffers(1, &stencilId);
+			glBindRenderbuffer(GL_RENDERBUFFER, stencilId);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		}
+		ownsStencil = (owner == NULL);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, stencilId);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void Use() {	// the next draw calls render into it
+		glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
+		glViewport(0, 0, width, height);
+	}
+
+	void Bind(unsigned int textureUnit, int color = 0) {
+		glActiveTexture(GL_TEXTURE0 + textureUnit);
+		glBindTexture(GL_TEXTURE_2D, textureIds[color]);
+	}
+
+	void BindImage(unsigned int imageUnit, int color = 0) {	// written by imageStore of a compute shader, GL 4.3
+		glBindImageTexture(imageUnit, textureIds[color], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	}
+
+	// stretched bilinearly to a screen of another size, then the default framebuffer is bound again
+	void BlitToScreen(int screenWidth, int screenHeight) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebufferId);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		GLenum filter = (screenWidth == width && screenHeight == height) ? GL_NEAREST : GL_LINEAR;
+		glBlitFramebuffer(0, 0, width, height, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, filter);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	void Destroy() {
+		if (framebufferId) glDeleteFramebuffers(1, &framebufferId);
+		if (nColors) glDeleteTextures(nColors, textureIds);
+		if (ownsStencil) glDeleteRenderbuffers(1, &stencilId);
+		framebufferId = stencilId = 0;
+		nColors = 0;
+		ownsStencil = false;
+	}
+
+	~RenderTarget() { Destroy(); }
+};
+
 //---------------------------
 class GPUProgram {
 //--------------------------
+	struct UniformInfo {
+		int location;
+		GLenum type;
+	};
+
 	unsigned int shaderProgramId;
+	std::map<std::string, UniformInfo> uniforms;	// active uniforms of the linked program by name
+
+	void listUniforms() {	// reflection after linking, array elements get their own "a[i]" entries
+		uniforms.clear();
+		int nUniforms = 0, maxLength = 0;
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORMS, &nUniforms);
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::vector<char> nameBuffer(maxLength + 1);
+		for (int i = 0; i < nUniforms; i++) {
+			int size;
+			GLenum type;
+			glGetActiveUniform(shaderProgramId, i, maxLength + 1, NULL, &size, &type, &nameBuffer[0]);
+			std::string name(&nameBuffer[0]);
+			int location = glGetUniformLocation(shaderProgramId, name.c_str());
+			if (location < 0) continue;		// member of a uniform block
+			size_t bracket = name.size() - 3;
+			if (size > 1 && name.size() > 3 && name.compare(bracket, 3, "[0]") == 0) {
+				// arrays of basic types are listed once with their size, GL does not promise consecutive element locations
+				std::string base = name.substr(0, bracket);
+				uniforms[base] = { location, type };
+				for (int e = 0; e < size; e++) {
+					char element[16];
+					sprintf(element, "[%d]", e);
+					std::string elementName = base + element;
+					int elementLocation = glGetUniformLocation(shaderProgramId, elementName.c_str());
+					if (elementLocation >= 0) uniforms[elementName] = { elementLocation, type };
+				}
+			}
+			else uniforms[name] = { location, type };
+		}
+	}
 
 	void getErrorInfo(unsigned int handle) { // shader error report
 		int logLen, written;
@@ -296,14 +836,78 @@ public:
 		// program packaging
 		glLinkProgram(shaderProgramId);
 		checkLinking(shaderProgramId);
+		listUniforms();
 
 		// make this program run
 		glUseProgram(shaderProgramId);
 	}
 
+	// a compute shader alone, run by glDispatchCompute, the source has no #version line, computeShaderHeader comes first
+	void CreateCompute(const char * const computeSource) {
+		unsigned int computeShader = glCreateShader(GL_COMPUTE_SHADER);
+		if (!computeShader) {
+			printf("Error in compute shader creation\n");
+			exit(1);
+		}
+		const char * sources[2] = { computeShaderHeader(), computeSource };
+		glShaderSource(computeShader, 2, sources, NULL);
+		glCompileShader(computeShader);
+		checkShader(computeShader, "Compute shader error");
+
+		shaderProgramId = glCreateProgram();
+		if (!shaderProgramId) {
+			printf("Error in shader program creation\n");
+			exit(1);
+		}
+		glAttachShader(shaderProgramId, computeShader);
+		glLinkProgram(shaderProgramId);
+		checkLinking(shaderProgramId);
+		listUniforms();
+		glUseProgram(shaderProgramId);
+	}
+
 	void Use() { 		// make this program run
 		glUseProgram(shaderProgramId);
 	}
 
+	// connects the named uniform block to a binding point, the GLSL block must be the given number of bytes
+	bool bindUniformBlock(const char * blockName, unsigned int bindingPoint, int size) const {
+		unsigned int blockIndex = glGetUniformBlockIndex(shaderProgramId, blockName);
+		if (blockIndex == GL_INVALID_INDEX) { printf("uniform block %s cannot be bound\n", blockName); return false; }
+		int blockSize = 0;
+		glGetActiveUniformBlockiv(shaderProgramId, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+		if (blockSize != size) printf("uniform block %s is %d bytes, its C++ struct is %d\n", blockName, blockSize, size);
+		glUniformBlockBinding(shaderProgramId, blockIndex, bindingPoint);
+		return blockSize == size;
+	}
+
+	template<typename T> bool bindUniformBlock(const char * blockName, const UniformBlock<T>& block) const {
+		return bindUniformBlock(blockName, block.getBindingPoint(), (int)sizeof(T));
+	}
+
+	int getBlockOffset(const char * name) const {	// byte offset of a uniform block member, -1 if it is not active
+		const char * names[1] = { name };
+		unsigned int index = GL_INVALID_INDEX;
+		glGetUniformIndices(shaderProgramId, 1, names, &index);
+		if (index == GL_INVALID_INDEX) return -1;
+		int offset = -1;
+		glGetActiveUniformsiv(shaderProgramId, 1, &index, GL_UNIFORM_OFFSET, &offset);
+		return offset;
+	}
+
+	// typed handle to keep, made once instead of looking the name up at every frame
+	template<typename T> Uniform<T> getUniform(const char * name) const {
+		std::map<std::string, UniformInfo>::const_iterator it = uniforms.find(name);
+		if (it == uniforms.end()) { printf("uniform %s cannot be set\n", name); return Uniform<T>(); }
+		if (!UniformType<T>::matches(it->second.type)) { printf("uniform %s has a different type\n", name); return Uniform<T>(); }
+		return Uniform<T>(it->second.location);
+	}
+
+	// as getUniform, but a uniform the program does not read gives an invalid handle without a report
+	template<typename T> Uniform<T> findUniform(const char * name) const {
+		if (uniforms.find(name) == uniforms.end()) return Uniform<T>();
+		return getUniform<T>(name);
+	}
+
 	~GPUProgram() { glDeleteProgram(shaderProgramId); }
 };
@@ -0,0 +1,226 @@
+//=============================================================================================
+// Structure-of-arrays batches of N (4, 8, 16) floats / vec3s / vec4s for loops over many objects.
+// Lanes are kept in SSE registers when FRAMEWORK_SIMD is on, branches are replaced by masks and select().
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+#if FRAMEWORK_SIMD
+#define BATCH_LANES(simd, scalar) for (int i = 0; i < N / 4; i++) { simd; }
+#else
+#define BATCH_LANES(simd, scalar) for (int i = 0; i < N; i++) { scalar; }
+#endif
+
+//--------------------------
+template<int N> struct maskN {	// every bit of lane i is set if the lane is on
+//--------------------------
+	static_assert(N % 4 == 0, "batches are made of whole SSE registers");
+#if FRAMEWORK_SIMD
+	union { int m[N]; __m128 q[N / 4]; };
+#else
+	int m[N];
+#endif
+
+	maskN() {}
+	maskN(bool b) { for (int i = 0; i < N; i++) m[i] = b ? -1 : 0; }
+
+	bool operator[](int i) const { return m[i] != 0; }
+
+	maskN operator&&(const maskN& o) const { maskN r; BATCH_LANES(r.q[i] = _mm_and_ps(q[i], o.q[i]), r.m[i] = m[i] & o.m[i]); return r; }
+	maskN operator||(const maskN& o) const { maskN r; BATCH_LANES(r.q[i] = _mm_or_ps(q[i], o.q[i]), r.m[i] = m[i] | o.m[i]); return r; }
+	maskN operator!() const { maskN r; BATCH_LANES(r.q[i] = _mm_xor_ps(q[i], _mm_castsi128_ps(_mm_set1_epi32(-1))), r.m[i] = ~m[i]); return r; }
+};
+
+template<int N> inline int count(const maskN<N>& a) {	// number of lanes on
+	int r = 0;
+#if FRAMEWORK_SIMD
+	static const int bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+	for (int i = 0; i < N / 4; i++) r += bits[_mm_movemask_ps(a.q[i])];
+#else
+	for (int i = 0; i < N; i++) r += a.m[i] & 1;
+#endif
+	return r;
+}
+
+template<int N> inline bool any(const maskN<N>& a) { return count(a) > 0; }
+
+template<int N> inline bool all(const maskN<N>& a) { return count(a) == N; }
+
+template<int N> inline maskN<N> firstLanes(int n) {	// lanes [0, n) on, used for the tail of an array
+	maskN<N> r;
+	for (int i = 0; i < N; i++) r.m[i] = i < n ? -1 : 0;
+	return r;
+}
+
+//--------------------------
+template<int N> struct floatN {
+//--------------------------
+	static_assert(N % 4 == 0, "batches are made of whole SSE registers");
+#if FRAMEWORK_SIMD
+	union { float v[N]; __m128 q[N / 4]; };
+#else
+	float v[N];
+#endif
+
+	floatN() {}
+	floatN(float a) { BATCH_LANES(q[i] = _mm_set1_ps(a), v[i] = a); }
+
+	float& operator[](int i) { return v[i]; }
+	float operator[](int i) const { return v[i]; }
+
+	floatN operator+(const floatN& o) const { floatN r; BATCH_LANES(r.q[i] = _mm_add_ps(q[i], o.q[i]), r.v[i] = v[i] + o.v[i]); return r; }
+	floatN operator-(const floatN& o) const { floatN r; BATCH_LANES(r.q[i] = _mm_sub_ps(q[i], o.q[i]), r.v[i] = v[i] - o.v[i]); return r; }
+	floatN operator*(const floatN& o) const { floatN r; BATCH_LANES(r.q[i] = _mm_mul_ps(q[i], o.q[i]), r.v[i] = v[i] * o.v[i]); return r; }
+	floatN operator/(const floatN& o) const { floatN r; BATCH_LANES(r.q[i] = _mm_div_ps(q[i], o.q[i]), r.v[i] = v[i] / o.v[i]); return r; }
+	floatN operator-() const { floatN r; BATCH_LANES(r.q[i] = _mm_sub_ps(_mm_setzero_ps(), q[i]), r.v[i] = -v[i]); return r; }
+
+	maskN<N> operator<(const floatN& o) const { maskN<N> r; BATCH_LANES(r.q[i] = _mm_cmplt_ps(q[i], o.q[i]), r.m[i] = v[i] < o.v[i] ? -1 : 0); return r; }
+	maskN<N> operator<=(const floatN& o) const { maskN<N> r; BATCH_LANES(r.q[i] = _mm_cmple_ps(q[i], o.q[i]), r.m[i] = v[i] <= o.v[i] ? -1 : 0); return r; }
+	maskN<N> operator>(const floatN& o) const { return o < *this; }
+	maskN<N> operator>=(const floatN& o) const { return o <= *this; }
+};
+
+template<int N> inline floatN<N> operator*(float a, const floatN<N>& b) { return floatN<N>(a) * b; }
+
+template<int N> inline floatN<N> sqrt(const floatN<N>& a) {
+	floatN<N> r;
+	BATCH_LANES(r.q[i] = _mm_sqrt_ps(a.q[i]), r.v[i] = sqrtf(a.v[i]));
+	return r;
+}
+
+template<int N> inline floatN<N> min(const floatN<N>& a, const floatN<N>& b) {
+	floatN<N> r;
+	BATCH_LANES(r.q[i] = _mm_min_ps(a.q[i], b.q[i]), r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]);
+	return r;
+}
+
+template<int N> inline floatN<N> max(const floatN<N>& a, const floatN<N>& b) {
+	floatN<N> r;
+	BATCH_LANES(r.q[i] = _mm_max_ps(a.q[i], b.q[i]), r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]);
+	return r;
+}
+
+template<int N> inline floatN<N> select(const maskN<N>& mask, const floatN<N>& a, const floatN<N>& b) {	// mask ? a : b
+	floatN<N> r;
+	BATCH_LANES(r.q[i] = _mm_or_ps(_mm_and_ps(mask.q[i], a.q[i]), _mm_andnot_ps(mask.q[i], b.q[i])),
+		r.v[i] = mask.m[i] ? a.v[i] : b.v[i]);
+	return r;
+}
+
+template<int N> inline float hsum(const floatN<N>& a) {	// sum of the lanes
+	float s = 0;
+	for (int i = 0; i < N; i++) s += a.v[i];
+	return s;
+}
+
+//--------------------------
+template<int N> struct vec3N {
+//--------------------------
+	floatN<N> x, y, z;
+
+	vec3N() {}
+	vec3N(const floatN<N>& x0, const floatN<N>& y0, const floatN<N>& z0) : x(x0), y(y0), z(z0) {}
+	vec3N(const vec3& v) : x(v.x), y(v.y), z(v.z) {}	// same vector in every lane
+
+	vec3 lane(int i) const { return vec3(x.v[i], y.v[i], z.v[i]); }
+	void setLane(int i, const vec3& v) { x.v[i] = v.x; y.v[i] = v.y; z.v[i] = v.z; }
+
+	// loads at most N elements from src[first...], missing lanes are zero; returns the valid lanes
+	maskN<N> load(const std::vector<vec3>& src, int first) {
+		int n = (int)src.size() - first;
+		if (n > N) n = N;
+		*this = vec3N(vec3(0, 0, 0));
+		for (int i = 0; i < n; i++) setLane(i, src[first + i]);
+		return firstLanes<N>(n);
+	}
+	void store(std::vector<vec3>& dst, int first) const {	// writes back the lanes that exist in dst
+		int n = (int)dst.size() - first;
+		if (n > N) n = N;
+		for (int i = 0; i < n; i++) dst[first + i] = lane(i);
+	}
+
+	vec3N operator+(const vec3N& v) const { return vec3N(x + v.x, y + v.y, z + v.z); }
+	vec3N operator-(const vec3N& v) const { return vec3N(x - v.x, y - v.y, z - v.z); }
+	vec3N operator*(const vec3N& v) const { return vec3N(x * v.x, y * v.y, z * v.z); }
+	vec3N operator*(const floatN<N>& a) const { return vec3N(x * a, y * a, z * a); }
+	vec3N operator*(float a) const { return *this * floatN<N>(a); }
+	vec3N operator-() const { return vec3N(-x, -y, -z); }
+};
+
+template<int N> inline floatN<N> dot(const vec3N<N>& v1, const vec3N<N>& v2) {
+	return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+}
+
+template<int N> inline floatN<N> length(const vec3N<N>& v) { return sqrt(dot(v, v)); }
+
+template<int N> inline vec3N<N> normalize(const vec3N<N>& v) { return v * (floatN<N>(1) / length(v)); }
+
+template<int N> inline vec3N<N> cross(const vec3N<N>& v1, const vec3N<N>& v2) {
+	return vec3N<N>(v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
+}
+
+template<int N> inline vec3N<N> min(const vec3N<N>& a, const vec3N<N>& b) { return vec3N<N>(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)); }
+
+template<int N> inline vec3N<N> max(const vec3N<N>& a, const vec3N<N>& b) { return vec3N<N>(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)); }
+
+template<int N> inline vec3N<N> select(const maskN<N>& mask, const vec3N<N>& a, const vec3N<N>& b) {
+	return vec3N<N>(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+}
+
+//--------------------------
+template<int N> struct vec4N {
+//--------------------------
+	floatN<N> x, y, z, w;
+
+	vec4N() {}
+	vec4N(const floatN<N>& x0, const floatN<N>& y0, const floatN<N>& z0, const floatN<N>& w0) : x(x0), y(y0), z(z0), w(w0) {}
+	vec4N(const vec4& v) : x(v.x), y(v.y), z(v.z), w(v.w) {}	// same vector in every lane
+
+	vec4 lane(int i) const { return vec4(x.v[i], y.v[i], z.v[i], w.v[i]); }
+	void setLane(int i, const vec4& v) { x.v[i] = v.x; y.v[i] = v.y; z.v[i] = v.z; w.v[i] = v.w; }
+
+	maskN<N> load(const std::vector<vec4>& src, int first) {
+		int n = (int)src.size() - first;
+		if (n > N) n = N;
+		*this = vec4N(vec4(0, 0, 0, 0));
+		for (int i = 0; i < n; i++) setLane(i, src[first + i]);
+		return firstLanes<N>(n);
+	}
+	void store(std::vector<vec4>& dst, int first) const {
+		int n = (int)dst.size() - first;
+		if (n > N) n = N;
+		for (int i = 0; i < n; i++) dst[first + i] = lane(i);
+	}
+
+	vec4N operator+(const vec4N& v) const { return vec4N(x + v.x, y + v.y, z + v.z, w + v.w); }
+	vec4N operator-(const vec4N& v) const { return vec4N(x - v.x, y - v.y, z - v.z, w - v.w); }
+	vec4N operator*(const vec4N& v) const { return vec4N(x * v.x, y * v.y, z * v.z, w * v.w); }
+	vec4N operator*(const floatN<N>& a) const { return vec4N(x * a, y * a, z * a, w * a); }
+	vec4N operator*(float a) const { return *this * floatN<N>(a); }
+
+	vec4N operator*(const mat4& mat) const {	// every lane times the same matrix
+		return vec4N(x * mat.m[0][0] + y * mat.m[1][0] + z * mat.m[2][0] + w * mat.m[3][0],
+			x * mat.m[0][1] + y * mat.m[1][1] + z * mat.m[2][1] + w * mat.m[3][1],
+			x * mat.m[0][2] + y * mat.m[1][2] + z * mat.m[2][2] + w * mat.m[3][2],
+			x * mat.m[0][3] + y * mat.m[1][3] + z * mat.m[2][3] + w * mat.m[3][3]);
+	}
+};
+
+template<int N> inline floatN<N> dot(const vec4N<N>& v1, const vec4N<N>& v2) {
+	return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w;
+}
+
+template<int N> inline vec4N<N> min(const vec4N<N>& a, const vec4N<N>& b) { return vec4N<N>(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z), min(a.w, b.w)); }
+
+template<int N> inline vec4N<N> max(const vec4N<N>& a, const vec4N<N>& b) { return vec4N<N>(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z), max(a.w, b.w)); }
+
+template<int N> inline vec4N<N> select(const maskN<N>& mask, const vec4N<N>& a, const vec4N<N>& b) {
+	return vec4N<N>(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z), select(mask, a.w, b.w));
+}
+
+#undef BATCH_LANES
+
+typedef maskN<4> maskx4;	typedef maskN<8> maskx8;	typedef maskN<16> maskx16;
+typedef floatN<4> floatx4;	typedef floatN<8> floatx8;	typedef floatN<16> floatx16;
+typedef vec3N<4> vec3x4;	typedef vec3N<8> vec3x8;	typedef vec3N<16> vec3x16;
+typedef vec4N<4> vec4x4;	typedef vec4N<8> vec4x8;	typedef vec4N<16> vec4x16;
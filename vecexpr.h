@@ -0,0 +1,113 @@
+//=============================================================================================
+// Opt-in expression templates over vec3 / vec4: ex(v) wraps a vector, and the operators on the
+// wrapped values build an expression that is evaluated component by component in one loop, when
+// it is converted back to a vector or passed to assign(). There are no intermediate vectors.
+//    assign(force, ex(force) - ex(n) * 2 * dot(force, n));
+// Only component-wise operations are provided, so a vector may appear on both sides of assign().
+//=============================================================================================
+#pragma once
+#include "framework.h"
+
+template<int D> struct VecOfDim;
+template<> struct VecOfDim<3> { typedef vec3 type; };
+template<> struct VecOfDim<4> { typedef vec4 type; };
+
+//--------------------------
+template<int D, class E> struct VecExpr {	// base of every expression node, D is the number of components
+//--------------------------
+	typedef typename VecOfDim<D>::type Vec;
+
+	float at(int i) const { return static_cast<const E&>(*this).at(i); }
+
+	operator Vec() const {
+		Vec r;
+		float * p = &r.x;
+		for (int i = 0; i < D; i++) p[i] = at(i);
+		return r;
+	}
+};
+
+//--------------------------
+template<int D> struct VecLeaf : public VecExpr<D, VecLeaf<D> > {	// the vector must outlive the expression
+//--------------------------
+	const float * p;
+	VecLeaf(const float * _p) : p(_p) {}
+	float at(int i) const { return p[i]; }
+};
+
+inline VecLeaf<3> ex(const vec3& v) { return VecLeaf<3>(&v.x); }
+inline VecLeaf<4> ex(const vec4& v) { return VecLeaf<4>(&v.x); }
+
+//--------------------------
+template<int D, class A, class B, class Op> struct VecBinary : public VecExpr<D, VecBinary<D, A, B, Op> > {
+//--------------------------
+	A a; B b;
+	VecBinary(const A& _a, const B& _b) : a(_a), b(_b) {}
+	float at(int i) const { return Op::apply(a.at(i), b.at(i)); }
+};
+
+//--------------------------
+template<int D, class A> struct VecScaled : public VecExpr<D, VecScaled<D, A> > {
+//--------------------------
+	A a; float s;
+	VecScaled(const A& _a, float _s) : a(_a), s(_s) {}
+	float at(int i) const { return a.at(i) * s; }
+};
+
+//--------------------------
+template<int D, class A> struct VecNegated : public VecExpr<D, VecNegated<D, A> > {
+//--------------------------
+	A a;
+	VecNegated(const A& _a) : a(_a) {}
+	float at(int i) const { return -a.at(i); }
+};
+
+struct ExprAdd { static float apply(float a, float b) { return a + b; } };
+struct ExprSub { static float apply(float a, float b) { return a - b; } };
+struct ExprMul { static float apply(float a, float b) { return a * b; } };
+
+template<int D, class A, class B>
+inline VecBinary<D, A, B, ExprAdd> operator+(const VecExpr<D, A>& a, const VecExpr<D, B>& b) {
+	return VecBinary<D, A, B, ExprAdd>(static_cast<const A&>(a), static_cast<const B&>(b));
+}
+
+template<int D, class A, class B>
+inline VecBinary<D, A, B, ExprSub> operator-(const VecExpr<D, A>& a, const VecExpr<D, B>& b) {
+	return VecBinary<D, A, B, ExprSub>(static_cast<const A&>(a), static_cast<const B&>(b));
+}
+
+template<int D, class A, class B>
+inline VecBinary<D, A, B, ExprMul> operator*(const VecExpr<D, A>& a, const VecExpr<D, B>& b) {
+	return VecBinary<D, A, B, ExprMul>(static_cast<const A&>(a), static_cast<const B&>(b));
+}
+
+template<int D, class A>
+inline VecScaled<D, A> operator*(const VecExpr<D, A>& a, float s) { return VecScaled<D, A>(static_cast<const A&>(a), s); }
+
+template<int D, class A>
+inline VecScaled<D, A> operator*(float s, const VecExpr<D, A>& a) { return VecScaled<D, A>(static_cast<const A&>(a), s); }
+
+template<int D, class A>
+inline VecNegated<D, A> operator-(const VecExpr<D, A>& a) { return VecNegated<D, A>(static_cast<const A&>(a)); }
+
+template<int D, class A, class B>
+inline float dot(const VecExpr<D, A>& a, const VecExpr<D, B>& b) {	// reductions are evaluated right away
+	float s = 0;
+	for (int i = 0; i < D; i++) s += a.at(i) * b.at(i);
+	return s;
+}
+
+template<int D, class E>
+inline typename VecOfDim<D>::type eval(const VecExpr<D, E>& e) { return e; }
+
+template<class E>
+inline void assign(vec3& dst, const VecExpr<3, E>& e) {
+	float x = e.at(0), y = e.at(1), z = e.at(2);
+	dst.x = x; dst.y = y; dst.z = z;
+}
+
+template<class E>
+inline void assign(vec4& dst, const VecExpr<4, E>& e) {
+	float x = e.at(0), y = e.at(1), z = e.at(2), w = e.at(3);
+	dst.x = x; dst.y = y; dst.z = z; dst.w = w;
+}